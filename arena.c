@@ -0,0 +1,70 @@
+#include <stdlib.h>
+
+#include "arena.h"
+#include "fail.h"
+
+/* allocations are aligned to the size of this type */
+typedef union {
+	long l;
+	double d;
+	void *p;
+} ALIGN;
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	ALIGN data[1];				/* size bytes follow */
+};
+
+void *
+arena_alloc(ARENA *arena, size_t size)
+{
+	ARENA_BLOCK *pb;
+	size_t alloc;
+
+	size = (size + sizeof(ALIGN) - 1) / sizeof(ALIGN) * sizeof(ALIGN);
+	/* blocks after the current one are free since the last reset */
+	while (arena->cur && arena->cur->used + size > arena->cur->size
+	  && (pb = arena->cur->next)) {
+		pb->used = 0;
+		arena->cur = pb;
+	}
+	if (arena->cur == 0 || arena->cur->used + size > arena->cur->size) {
+		alloc = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		if ( (pb = malloc(sizeof(ARENA_BLOCK) + alloc)) == 0)
+			fail_prog("Could not allocate %lu bytes of memory",
+			  (unsigned long)(sizeof(ARENA_BLOCK) + alloc));
+		pb->size = alloc;
+		pb->used = 0;
+		pb->next = 0;
+		if (arena->cur)
+			arena->cur->next = pb;
+		else
+			arena->first = pb;
+		arena->cur = pb;
+	}
+	arena->allocs++;
+	arena->bytes += size;
+	pb = arena->cur;
+	pb->used += size;
+	return (char *)pb->data + pb->used - size;
+}
+
+void
+arena_reset(ARENA *arena)
+{
+	if ( (arena->cur = arena->first) )
+		arena->cur->used = 0;
+}
+
+void
+arena_free(ARENA *arena)
+{
+	ARENA_BLOCK *pb, *next;
+
+	for (pb = arena->first; pb; pb = next) {
+		next = pb->next;
+		free(pb);
+	}
+	arena->first = arena->cur = 0;
+}
@@ -0,0 +1,18 @@
+#include "prefix.h"
+
+/*
+ * bump allocator: memory is released all at once by arena_reset(),
+ * the blocks are kept and reused for the next allocations
+ */
+typedef struct arena_block ARENA_BLOCK;
+
+typedef struct {
+	ARENA_BLOCK *first, *cur;
+	unsigned long allocs, bytes;	/* statistics, never reset */
+} ARENA;
+
+#define ARENA_BLOCK_SIZE	32768
+
+extern void *arena_alloc(ARENA *, size_t);
+extern void arena_reset(ARENA *);
+extern void arena_free(ARENA *);
@@ -0,0 +1,270 @@
+/*
+ * bench - benchmark harness for libcpexif
+ *
+ * Usage: bench corpus_directory [runs [normal|hint|drop [uring|stdio]]]
+ *
+ * All pairs listed in 'pairs.txt' (see mkcorpus) are processed
+ * in each run. Every pair writes to its own copy of the destination
+ * in the 'work' subdirectory; the copies are restored before each run
+ * and only the library calls are timed. The third argument selects
+ * the page cache policy; after each run the part of the sources and
+ * destinations left in the page cache is reported. The last one
+ * selects how the large blocks of the destinations are written.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcpexif.h"
+
+#define MAX_PAIRS	1024
+#define MAX_RUNS	100
+
+static const char *phase_name[CPEXIF_PHASES] = {
+	"parse", "build", "copy", "finish"
+};
+
+static struct {
+	char src[512], dst[512], work[512];
+} pair[MAX_PAIRS];
+static int pairs;
+
+/* results of one run */
+typedef struct {
+	double files, mbytes;		/* per second */
+	double phase[CPEXIF_PHASES];	/* milliseconds per file */
+	double cached;				/* MB of the files in the page cache */
+} RESULT;
+
+static const char *policy_name[] = { "normal", "hint", "drop" };
+static const int policy_flags[] = { CPEXIF_NOADVICE, 0, CPEXIF_DROPCACHE };
+static const char *engine_name[] = { "uring", "stdio" };
+static const int engine_flags[] = { 0, CPEXIF_NOURING };
+
+static double
+wall_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fail(const char *msg, const char *arg)
+{
+	fprintf(stderr,"bench: %s '%s'\n",msg,arg);
+	exit(1);
+}
+
+static void
+read_pairs(const char *dir)
+{
+	char path[1024], line[1024], *src, *dst;
+	FILE *fp;
+
+	sprintf(path,"%s/pairs.txt",dir);
+	if ( (fp = fopen(path,"r")) == 0)
+		fail("cannot read",path);
+	while (fgets(line,sizeof(line),fp)) {
+		if ( (src = strtok(line,"\t\n")) == 0
+		  || (dst = strtok(0,"\t\n")) == 0)
+			continue;
+		if (pairs == MAX_PAIRS)
+			fail("too many pairs in",path);
+		sprintf(pair[pairs].src,"%s/%s",dir,src);
+		sprintf(pair[pairs].dst,"%s/%s",dir,dst);
+		sprintf(pair[pairs].work,"%s/work/%04d.jpg",dir,pairs);
+		pairs++;
+	}
+	fclose(fp);
+	if (pairs == 0)
+		fail("no pairs in",path);
+}
+
+static void
+copy_file(const char *from, const char *to)
+{
+	static char buff[65536];
+	FILE *in, *out;
+	size_t len;
+
+	if ( (in = fopen(from,"rb")) == 0)
+		fail("cannot read",from);
+	if ( (out = fopen(to,"wb")) == 0)
+		fail("cannot write",to);
+	while ( (len = fread(buff,1,sizeof(buff),in)) )
+		if (fwrite(buff,1,len,out) != len)
+			fail("cannot write",to);
+	fclose(in);
+	if (fclose(out))
+		fail("cannot write",to);
+}
+
+/* bytes of the file in the page cache */
+static double
+resident(const char *file)
+{
+	struct stat st;
+	unsigned char *vec;
+	size_t pages, i, page;
+	double bytes;
+	void *map;
+	int fd;
+
+	if ( (fd = open(file,O_RDONLY)) < 0)
+		return 0;
+	bytes = 0;
+	page = sysconf(_SC_PAGESIZE);
+	if (fstat(fd,&st) == 0 && st.st_size > 0
+	  && (map = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0))
+	  != MAP_FAILED) {
+		pages = (st.st_size + page - 1) / page;
+		if ( (vec = malloc(pages)) && mincore(map,st.st_size,vec) == 0)
+			for (i = 0; i < pages; i++)
+				if (vec[i] & 1)
+					bytes += page;
+		free(vec);
+		munmap(map,st.st_size);
+	}
+	close(fd);
+	return bytes;
+}
+
+static void
+run(CPEXIF_JOB *job, RESULT *res)
+{
+	double t0, elapsed, before[CPEXIF_PHASES];
+	const double *timing;
+	struct stat st;
+	double bytes;
+	int i;
+
+	for (i = 0; i < pairs; i++)
+		copy_file(pair[i].dst,pair[i].work);
+
+	timing = cpexif_timing(job);
+	memcpy(before,timing,sizeof(before));
+	for (elapsed = bytes = 0, i = 0; i < pairs; i++) {
+		t0 = wall_clock();
+		if (cpexif_load_file(job,pair[i].src) != CPEXIF_OK
+		  || cpexif_write_file(job,pair[i].work) != CPEXIF_OK)
+			fail(cpexif_error(job),pair[i].src);
+		elapsed += wall_clock() - t0;
+		if (stat(pair[i].work,&st) == 0)
+			bytes += st.st_size;
+	}
+
+	res->files = pairs / elapsed;
+	res->mbytes = bytes / elapsed / 1e6;
+	for (i = 0; i < CPEXIF_PHASES; i++)
+		res->phase[i] = (timing[i] - before[i]) * 1e3 / pairs;
+	/* a source used by several pairs is counted each time */
+	for (res->cached = 0, i = 0; i < pairs; i++)
+		res->cached += resident(pair[i].src) + resident(pair[i].work);
+	res->cached /= 1e6;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x, y;
+
+	x = *(const double *)a;
+	y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* median of one RESULT member over all runs */
+static double
+median(RESULT *res, int runs, size_t member)
+{
+	double val[MAX_RUNS];
+	int i;
+
+	for (i = 0; i < runs; i++)
+		val[i] = *(double *)((char *)(res + i) + member);
+	qsort(val,runs,sizeof(double),cmp_double);
+	return runs % 2 ? val[runs / 2] : (val[runs / 2 - 1] + val[runs / 2]) / 2;
+}
+
+static void
+print_result(const char *label, double files, double mbytes,
+  const double *phase, double cached)
+{
+	int i;
+
+	printf("%-6s %9.1f %9.1f",label,files,mbytes);
+	for (i = 0; i < CPEXIF_PHASES; i++)
+		printf(" %9.3f",phase[i]);
+	printf(" %9.1f\n",cached);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static RESULT res[MAX_RUNS];
+	CPEXIF_JOB *job;
+	double phase[CPEXIF_PHASES];
+	char label[16], path[1024];
+	int runs, policy, engine, i;
+
+	if (argc < 2 || argc > 5) {
+		fputs("Usage: bench corpus_directory "
+		  "[runs [normal|hint|drop [uring|stdio]]]\n",stderr);
+		return 1;
+	}
+	runs = argc >= 3 ? atoi(argv[2]) : 5;
+	if (runs < 1 || runs > MAX_RUNS)
+		fail("invalid number of runs",argv[2]);
+	policy = 1;
+	if (argc >= 4)
+		for (policy = 0; policy < 3
+		  && strcmp(argv[3],policy_name[policy]); policy++)
+			;
+	if (policy == 3)
+		fail("unknown page cache policy",argv[3]);
+	engine = 0;
+	if (argc == 5)
+		for (engine = 0; engine < 2
+		  && strcmp(argv[4],engine_name[engine]); engine++)
+			;
+	if (engine == 2)
+		fail("unknown write engine",argv[4]);
+	read_pairs(argv[1]);
+	sprintf(path,"%s/work",argv[1]);
+	mkdir(path,0755);
+	if ( (job = cpexif_new(policy_flags[policy] | engine_flags[engine])) == 0)
+		fail("cannot create a job","");
+
+	printf("%d pairs, %d runs, page cache policy '%s', writes '%s'; "
+	  "phase times in ms per file\n",pairs,runs,policy_name[policy],
+	  engine_name[engine]);
+	printf("%-6s %9s %9s","run","files/s","MB/s");
+	for (i = 0; i < CPEXIF_PHASES; i++)
+		printf(" %9s",phase_name[i]);
+	printf(" %9s\n","cached MB");
+	for (i = 0; i < runs; i++) {
+		run(job,res + i);
+		sprintf(label,"%d",i + 1);
+		print_result(label,res[i].files,res[i].mbytes,res[i].phase,
+		  res[i].cached);
+	}
+	for (i = 0; i < CPEXIF_PHASES; i++)
+		phase[i] = median(res,runs,
+		  offsetof(RESULT,phase) + i * sizeof(double));
+	print_result("median",median(res,runs,offsetof(RESULT,files)),
+	  median(res,runs,offsetof(RESULT,mbytes)),phase,
+	  median(res,runs,offsetof(RESULT,cached)));
+
+	cpexif_free(job);
+	return 0;
+}
@@ -0,0 +1,216 @@
+/*
+ * client - test client for 'cpexif --serve'
+ *
+ * Usage: client socket [request_file]
+ *
+ * The request lines ("source destination [flags]") are read from the
+ * file or from the standard input and sent over one connection while
+ * the responses are being read. The responses are printed to the
+ * standard output, the request rate and the latencies measured by the
+ * client to the standard error. The exit status is 1 if any request
+ * was not answered with "ok" or "unchanged".
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LINE_MAX_LEN	8192
+
+static char *out;				/* request lines */
+static size_t out_len, out_pos;
+static size_t *line_end;		/* end of each request in out */
+static double *sent, *latency;	/* per request */
+static int requests;
+
+static double
+wall_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fail(const char *msg, const char *arg)
+{
+	fprintf(stderr,"client: %s '%s'\n",msg,arg);
+	exit(1);
+}
+
+static void *
+emalloc(void *old, size_t size)
+{
+	void *mem;
+
+	if ( (mem = realloc(old,size)) == 0)
+		fail("cannot allocate memory","");
+	return mem;
+}
+
+/* empty lines and comments are not sent, the server skips them */
+static void
+read_requests(FILE *fp)
+{
+	static char line[LINE_MAX_LEN];
+	size_t len, alloc, lalloc;
+
+	alloc = lalloc = 0;
+	while (fgets(line,sizeof(line),fp)) {
+		len = strcspn(line,"\r\n");
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (out_len + len + 1 > alloc) {
+			alloc = 2 * (out_len + len + 1);
+			out = emalloc(out,alloc);
+		}
+		if (requests == lalloc) {
+			lalloc = lalloc ? 2 * lalloc : 256;
+			line_end = emalloc(line_end,lalloc * sizeof(size_t));
+		}
+		memcpy(out + out_len,line,len);
+		out[out_len + len] = '\n';
+		out_len += len + 1;
+		line_end[requests++] = out_len;
+	}
+	sent = emalloc(0,(requests + 1) * sizeof(double));
+	latency = emalloc(0,(requests + 1) * sizeof(double));
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double da, db;
+
+	da = *(const double *)a;
+	db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char in[LINE_MAX_LEN * 2];
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	FILE *fp;
+	char *line, *end, *status;
+	size_t in_len;
+	ssize_t rv;
+	double start, elapsed, sum;
+	int fd, next, num, answered, failed, eof;
+
+	if (argc < 2 || argc > 3) {
+		fputs("Usage: client socket [request_file]\n",stderr);
+		return 1;
+	}
+	if (argc == 3) {
+		if ( (fp = fopen(argv[2],"r")) == 0)
+			fail("cannot read",argv[2]);
+	}
+	else
+		fp = stdin;
+	read_requests(fp);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof(addr.sun_path))
+		fail("socket name is too long",argv[1]);
+	strcpy(addr.sun_path,argv[1]);
+	if ( (fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0
+	  || connect(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0)
+		fail("cannot connect to",argv[1]);
+	fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+	signal(SIGPIPE,SIG_IGN);
+	if (requests == 0)
+		shutdown(fd,SHUT_WR);
+
+	/* the server may stop reading, so writing and reading alternate */
+	start = wall_clock();
+	next = answered = failed = eof = 0;
+	in_len = 0;
+	while (!eof) {
+		pfd.fd = fd;
+		pfd.events = POLLIN | (out_pos < out_len ? POLLOUT : 0);
+		if (poll(&pfd,1,-1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("cannot wait for",argv[1]);
+		}
+		if ((pfd.revents & POLLOUT) && out_pos < out_len) {
+			if ( (rv = write(fd,out + out_pos,out_len - out_pos)) < 0) {
+				/* a stopped server takes no more requests */
+				if (errno == EPIPE || errno == ECONNRESET)
+					out_pos = out_len;
+				else if (errno != EAGAIN && errno != EINTR)
+					fail("cannot write to",argv[1]);
+			}
+			else {
+				out_pos += rv;
+				for (; next < requests && line_end[next] <= out_pos; next++)
+					sent[next] = wall_clock();
+				if (out_pos == out_len)
+					shutdown(fd,SHUT_WR);
+			}
+		}
+		if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		if ( (rv = read(fd,in + in_len,sizeof(in) - in_len)) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			if (errno != ECONNRESET)
+				fail("cannot read from",argv[1]);
+			rv = 0;
+		}
+		if (rv == 0)
+			eof = 1;
+		in_len += rv;
+		for (line = in; (end = memchr(line,'\n',in + in_len - line));
+		  line = end + 1) {
+			*end = '\0';
+			puts(line);
+			if (answered == requests)
+				fail("unexpected response from",argv[1]);
+			/* "request":N is the number of the request line, from 1 */
+			if (sscanf(line,"{\"request\":%d",&num) == 1
+			  && num >= 1 && num <= requests)
+				latency[answered] = (wall_clock() - sent[num - 1]) * 1e3;
+			else
+				latency[answered] = 0;
+			answered++;
+			if ( (status = strstr(line,"\"status\":\"")) == 0
+			  || (strncmp(status + 10,"ok\"",3)
+			  && strncmp(status + 10,"unchanged\"",10)))
+				failed++;
+		}
+		in_len -= line - in;
+		memmove(in,line,in_len);
+		if (in_len == sizeof(in))
+			fail("response too long from",argv[1]);
+	}
+	elapsed = wall_clock() - start;
+	close(fd);
+
+	fprintf(stderr,"%d requests, %d answered, %d failed, %.3f s, "
+	  "%.1f requests/s\n",requests,answered,failed,elapsed,
+	  elapsed > 0 ? answered / elapsed : 0.0);
+	if (answered > 0) {
+		for (sum = 0, num = 0; num < answered; num++)
+			sum += latency[num];
+		qsort(latency,answered,sizeof(double),cmp_double);
+		fprintf(stderr,"latency ms: mean %.3f, median %.3f, "
+		  "99%% %.3f, max %.3f\n",sum / answered,latency[answered / 2],
+		  latency[(answered - 1) * 99 / 100],latency[answered - 1]);
+	}
+	return failed || answered < requests ? 1 : 0;
+}
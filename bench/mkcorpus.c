@@ -0,0 +1,644 @@
+/*
+ * mkcorpus - generates a synthetic benchmark corpus for cpexif
+ *
+ * Usage: mkcorpus directory
+ *
+ * TIFF based RAW files (Nikon NEF in both byte orders with all Nikon
+ * MakerNote layouts, Canon CR2, Sony ARW, Pentax PEF and DNG) and JPEG
+ * files of various sizes with and without APP0/APP1 segments are written
+ * to the directory together with the manifest 'pairs.txt' listing every
+ * source/destination pair.
+ * The output depends only on the fixed random seed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned long U32;
+
+#define BE	0x4D4D
+#define LE	0x4949
+
+/* makernote layouts, see the vendor classifiers in libcpexif.c */
+#define MK_IFD0		1	/* Nikon: IFD at offset 0 */
+#define MK_IFD8		2	/* Nikon: "Nikon" header, IFD at offset 8 */
+#define MK_TIFF		3	/* Nikon: "Nikon" header, own TIFF header at 10 */
+#define MK_CANON	4	/* Canon: IFD at offset 0 */
+#define MK_SONY		5	/* Sony: "SONY DSC" header, IFD at offset 12 */
+#define MK_AOC		6	/* Pentax: "AOC" header, IFD at offset 6 */
+#define MK_PENTAX	7	/* Pentax DNG: "PENTAX" header, IFD at offset 10,
+						   offsets relative to the MakerNote */
+
+/* Make and Model tags by the makernote layout */
+static const char *camera[][2] = {
+	{ 0, 0 },
+	{ "NIKON CORPORATION",	"NIKON D70" },
+	{ "NIKON CORPORATION",	"NIKON D70" },
+	{ "NIKON CORPORATION",	"NIKON D70" },
+	{ "Canon",				"Canon EOS 350D DIGITAL" },
+	{ "SONY",				"DSLR-A100" },
+	{ "PENTAX Corporation",	"PENTAX *ist DS" },
+	{ "PENTAX",				"PENTAX K10D" }
+};
+
+#define TYPE_BYTE		1
+#define TYPE_ASCII		2
+#define TYPE_USHORT		3
+#define TYPE_ULONG		4
+#define TYPE_URATIO		5
+#define TYPE_UNDEF		7
+
+#define MAX_ENTRIES	32
+
+static const char *outdir;
+
+/*** deterministic data ***/
+
+static U32 seed = 2005;
+
+static U32
+rnd(void)
+{
+	/* xorshift32 */
+	seed ^= (seed << 13) & 0xFFFFFFFF;
+	seed ^= seed >> 17;
+	seed ^= (seed << 5) & 0xFFFFFFFF;
+	return seed;
+}
+
+/*** growing byte buffer ***/
+
+typedef struct {
+	unsigned char *data;
+	size_t size, alloc;
+	int endian;
+} BUFF;
+
+static void
+reserve(BUFF *pb, size_t bytes)
+{
+	if (pb->size + bytes <= pb->alloc)
+		return;
+	pb->alloc = pb->size + bytes > 2 * pb->alloc ?
+	  pb->size + bytes : 2 * pb->alloc;
+	if ( (pb->data = realloc(pb->data,pb->alloc)) == 0) {
+		fputs("mkcorpus: out of memory\n",stderr);
+		exit(1);
+	}
+}
+
+static void
+put(BUFF *pb, const void *data, size_t bytes)
+{
+	reserve(pb,bytes);
+	memcpy(pb->data + pb->size,data,bytes);
+	pb->size += bytes;
+}
+
+static void
+put8(BUFF *pb, int val)
+{
+	unsigned char ch;
+
+	ch = val & 0xFF;
+	put(pb,&ch,1);
+}
+
+static void
+put16(BUFF *pb, U32 val)
+{
+	if (pb->endian == LE) {
+		put8(pb,val);
+		put8(pb,val >> 8);
+	}
+	else {
+		put8(pb,val >> 8);
+		put8(pb,val);
+	}
+}
+
+static void
+put32(BUFF *pb, U32 val)
+{
+	if (pb->endian == LE) {
+		put16(pb,val & 0xFFFF);
+		put16(pb,val >> 16);
+	}
+	else {
+		put16(pb,val >> 16);
+		put16(pb,val & 0xFFFF);
+	}
+}
+
+static void
+put_random(BUFF *pb, size_t bytes)
+{
+	reserve(pb,bytes);
+	while (bytes-- > 0)
+		pb->data[pb->size++] = rnd() >> 11;
+}
+
+static void
+save(BUFF *pb, const char *name)
+{
+	char path[1024];
+	FILE *fp;
+
+	sprintf(path,"%s/%s",outdir,name);
+	if ( (fp = fopen(path,"wb")) == 0
+	  || fwrite(pb->data,1,pb->size,fp) != pb->size || fclose(fp)) {
+		perror(path);
+		exit(1);
+	}
+	pb->size = 0;
+}
+
+/*** TIFF directories ***/
+
+typedef struct {
+	U32 tag, type, count;
+	BUFF value;				/* value bytes, endian of the directory */
+	int pointer;			/* flag: value is an offset set later */
+} ENTRY;
+
+typedef struct {
+	ENTRY entry[MAX_ENTRIES];
+	int cnt;
+	int endian;
+} IFD;
+
+static ENTRY *
+add(IFD *ifd, U32 tag, U32 type, U32 count)
+{
+	ENTRY *pe;
+
+	pe = ifd->entry + ifd->cnt++;
+	pe->tag = tag;
+	pe->type = type;
+	pe->count = count;
+	pe->value.size = 0;
+	pe->value.endian = ifd->endian;
+	pe->pointer = 0;
+	return pe;
+}
+
+static void
+add_short(IFD *ifd, U32 tag, U32 val)
+{
+	put16(&add(ifd,tag,TYPE_USHORT,1)->value,val);
+}
+
+static void
+add_long(IFD *ifd, U32 tag, U32 val)
+{
+	put32(&add(ifd,tag,TYPE_ULONG,1)->value,val);
+}
+
+/* the offset is stored by set_pointer() */
+static void
+add_pointer(IFD *ifd, U32 tag)
+{
+	add(ifd,tag,TYPE_ULONG,1)->pointer = 1;
+}
+
+static void
+add_ascii(IFD *ifd, U32 tag, const char *str)
+{
+	put(&add(ifd,tag,TYPE_ASCII,strlen(str) + 1)->value,str,strlen(str) + 1);
+}
+
+static void
+add_ratio(IFD *ifd, U32 tag, U32 count, U32 num, U32 den)
+{
+	ENTRY *pe;
+
+	pe = add(ifd,tag,TYPE_URATIO,count);
+	while (count-- > 0) {
+		put32(&pe->value,num++);
+		put32(&pe->value,den);
+	}
+}
+
+static void
+add_blob(IFD *ifd, U32 tag, U32 size)
+{
+	put_random(&add(ifd,tag,TYPE_UNDEF,size)->value,size);
+}
+
+static void
+set_pointer(IFD *ifd, U32 tag, U32 offset)
+{
+	int i;
+
+	for (i = 0; i < ifd->cnt; i++)
+		if (ifd->entry[i].tag == tag) {
+			ifd->entry[i].value.size = 0;
+			put32(&ifd->entry[i].value,offset);
+			return;
+		}
+}
+
+/* offset of the value of entry 'n' in a directory at 'start' */
+static U32
+value_offset(IFD *ifd, int n, U32 start)
+{
+	U32 off;
+	int i;
+
+	for (off = start + 2 + 12 * ifd->cnt + 4, i = 0; i < n; i++)
+		if (ifd->entry[i].value.size > 4)
+			off += (ifd->entry[i].value.size + 1) & ~1UL;
+	return off;
+}
+
+static U32
+ifd_size(IFD *ifd)
+{
+	return value_offset(ifd,ifd->cnt,0);
+}
+
+/*
+ * append the directory with its values, the stored offsets are
+ * positions in the buffer plus 'shift'
+ */
+static void
+put_ifd(BUFF *pb, IFD *ifd, long shift)
+{
+	U32 data;
+	ENTRY *pe;
+	int i;
+
+	data = value_offset(ifd,0,pb->size + shift);
+	put16(pb,ifd->cnt);
+	for (i = 0; i < ifd->cnt; i++) {
+		pe = ifd->entry + i;
+		put16(pb,pe->tag);
+		put16(pb,pe->type);
+		put32(pb,pe->count);
+		if (pe->value.size > 4) {
+			put32(pb,data);
+			data += (pe->value.size + 1) & ~1UL;
+		}
+		else {
+			put(pb,pe->value.data,pe->value.size);
+			put(pb,"\0\0\0",4 - pe->value.size);
+		}
+	}
+	put32(pb,0);
+	for (i = 0; i < ifd->cnt; i++) {
+		pe = ifd->entry + i;
+		if (pe->value.size > 4) {
+			put(pb,pe->value.data,pe->value.size);
+			if (pe->value.size % 2)
+				put8(pb,0);
+		}
+	}
+}
+
+static void
+free_ifd(IFD *ifd)
+{
+	int i;
+
+	for (i = 0; i < MAX_ENTRIES; i++)
+		free(ifd->entry[i].value.data);
+	memset(ifd,0,sizeof(IFD));
+}
+
+/*** TIFF based RAW ***/
+
+/* MakerNote directory, Nikon-like contents for all vendors */
+static void
+makernote_ifd(BUFF *pb, int endian, int layout, int iso, long shift)
+{
+	IFD mk;
+	ENTRY *pe;
+
+	memset(&mk,0,sizeof(mk));
+	mk.endian = endian;
+	put(&add(&mk,0x1,TYPE_UNDEF,4)->value,"0210",4);	/* version */
+	if (layout != MK_IFD8) {
+		pe = add(&mk,0x2,TYPE_USHORT,2);				/* ISO */
+		put16(&pe->value,0);
+		put16(&pe->value,iso);
+	}
+	add_ascii(&mk,0x4,"FINE   ");					/* quality */
+	add_ascii(&mk,0x5,"AUTO        ");				/* white balance */
+	if (layout == MK_IFD8)
+		add_short(&mk,0x6,iso == 100 ? 5 : 0);		/* ISO code */
+	add_ascii(&mk,0x7,"AF-S  ");					/* focus mode */
+	add_blob(&mk,0x11,512);							/* preview IFD */
+	add_blob(&mk,0x91,2048 + rnd() % 2048);			/* shot info */
+	add_blob(&mk,0x98,33);							/* lens data */
+	add_blob(&mk,0xA8,3072 + rnd() % 4096);			/* flash info */
+	put_ifd(pb,&mk,shift);
+	free_ifd(&mk);
+}
+
+/*
+ * MakerNote placed at file offset 'pos'; the IFD offsets are relative
+ * to the main TIFF header except in the layout with an own TIFF header
+ */
+static void
+makernote(BUFF *pb, int endian, int layout, int iso, U32 pos)
+{
+	int mkendian;
+
+	pb->endian = endian;
+	if (layout == MK_IFD0 || layout == MK_CANON) {
+		makernote_ifd(pb,endian,layout,iso,pos);
+		return;
+	}
+	if (layout == MK_SONY) {
+		put(pb,"SONY DSC \0\0\0",12);
+		makernote_ifd(pb,endian,layout,iso,pos);
+		return;
+	}
+	if (layout == MK_AOC || layout == MK_PENTAX) {
+		put(pb,layout == MK_AOC ? "AOC\0" : "PENTAX \0",
+		  layout == MK_AOC ? 4 : 8);
+		put16(pb,endian);
+		makernote_ifd(pb,endian,layout,iso,layout == MK_AOC ? pos : 0);
+		return;
+	}
+	put(pb,"Nikon\0",6);
+	if (layout == MK_IFD8) {
+		put(pb,"\1\0",2);
+		makernote_ifd(pb,endian,layout,iso,pos);
+		return;
+	}
+	/* the own TIFF header uses the opposite byte order on purpose */
+	mkendian = endian == BE ? LE : BE;
+	put(pb,"\2\20\0\0",4);
+	pb->endian = mkendian;
+	put16(pb,mkendian);
+	put16(pb,42);
+	put32(pb,8);
+	makernote_ifd(pb,mkendian,layout,iso,-10);
+}
+
+/*
+ * IFD0, EXIF (with the MakerNote), Interoperability and GPS directories
+ * followed by the image strip; iso = 0: the ISO tag is missing in EXIF;
+ * the MK_PENTAX layout makes a DNG file
+ */
+static void
+make_raw(const char *name, int endian, int layout, int iso, U32 image)
+{
+	BUFF raw;
+	IFD ifd0, exif, interop, gps;
+	ENTRY *pe;
+	U32 exif_off, interop_off, gps_off, strip_off;
+	int mk;
+
+	memset(&raw,0,sizeof(raw));
+	memset(&ifd0,0,sizeof(ifd0));
+	memset(&exif,0,sizeof(exif));
+	memset(&interop,0,sizeof(interop));
+	memset(&gps,0,sizeof(gps));
+	raw.endian = ifd0.endian = exif.endian = interop.endian
+	  = gps.endian = endian;
+
+	add_long(&ifd0,0xFE,1);						/* NewSubFileType */
+	add_long(&ifd0,0x100,160);					/* ImageWidth */
+	add_long(&ifd0,0x101,120);					/* ImageLength */
+	pe = add(&ifd0,0x102,TYPE_USHORT,3);		/* BitsPerSample */
+	put16(&pe->value,8);
+	put16(&pe->value,8);
+	put16(&pe->value,8);
+	add_short(&ifd0,0x103,1);					/* Compression */
+	add_short(&ifd0,0x106,2);					/* Photometric */
+	add_ascii(&ifd0,0x10F,camera[layout][0]);
+	add_ascii(&ifd0,0x110,camera[layout][1]);
+	add_pointer(&ifd0,0x111);					/* StripOffsets */
+	add_short(&ifd0,0x112,1);					/* Orientation */
+	add_short(&ifd0,0x115,3);					/* SamplesPerPixel */
+	add_long(&ifd0,0x116,120);					/* RowsPerStrip */
+	add_long(&ifd0,0x117,image);				/* StripByteCounts */
+	add_ratio(&ifd0,0x11A,1,300,1);				/* XResolution */
+	add_ratio(&ifd0,0x11B,1,300,1);				/* YResolution */
+	add_short(&ifd0,0x11C,1);					/* PlanarConfig */
+	add_short(&ifd0,0x128,2);					/* ResolutionUnit */
+	add_ascii(&ifd0,0x131,"Ver.2.00");			/* Software */
+	add_ascii(&ifd0,0x132,"2005:06:18 14:02:11");
+	add_blob(&ifd0,0x14A,8);					/* SubIFDs (dummy) */
+	add_ratio(&ifd0,0x214,6,0,1);				/* ReferenceBlackWhite */
+	add_ascii(&ifd0,0x8298,"Copyright (C) 2005 cpexif bench");
+	add_pointer(&ifd0,0x8769);					/* EXIF */
+	add_pointer(&ifd0,0x8825);					/* GPS */
+	add_blob(&ifd0,0x9216,4);					/* TIFF/EP */
+	if (layout == MK_PENTAX)
+		put(&add(&ifd0,0xC612,TYPE_BYTE,4)->value,"\1\4\0\0",4);
+												/* DNGVersion */
+
+	add_ratio(&exif,0x829A,1,1,250);			/* ExposureTime */
+	add_ratio(&exif,0x829D,1,56,10);			/* FNumber */
+	add_short(&exif,0x8822,2);					/* ExposureProgram */
+	if (iso)
+		add_short(&exif,0x8827,iso);			/* ISO */
+	put(&add(&exif,0x9000,TYPE_UNDEF,4)->value,"0221",4);
+	add_ascii(&exif,0x9003,"2005:06:18 14:02:11");
+	add_ascii(&exif,0x9004,"2005:06:18 14:02:11");
+	add_ratio(&exif,0x920A,1,500,10);			/* FocalLength */
+	mk = exif.cnt;
+	add(&exif,0x927C,TYPE_UNDEF,0);				/* MakerNote */
+	add_blob(&exif,0x9286,44);					/* UserComment */
+	add_short(&exif,0xA001,1);					/* ColorSpace */
+	add_pointer(&exif,0xA005);					/* Interoperability */
+
+	add_ascii(&interop,0x1,"R98");
+	put(&add(&interop,0x2,TYPE_UNDEF,4)->value,"0100",4);
+
+	put(&add(&gps,0x0,TYPE_BYTE,4)->value,"\2\2\0\0",4);
+	add_ascii(&gps,0x1,"N");
+	add_ratio(&gps,0x2,3,48,1);
+	add_ascii(&gps,0x3,"E");
+	add_ratio(&gps,0x4,3,17,1);
+	add_ratio(&gps,0x6,1,140,1);
+
+	/* layout: header, IFD0, EXIF, Interop, GPS, image strip */
+	exif_off = 8 + ifd_size(&ifd0);
+	/* the position of the MakerNote does not depend on its size */
+	pe = exif.entry + mk;
+	makernote(&pe->value,endian,layout,iso ? iso : 100,
+	  value_offset(&exif,mk,exif_off));
+	pe->count = pe->value.size;
+	interop_off = exif_off + ifd_size(&exif);
+	gps_off = interop_off + ifd_size(&interop);
+	strip_off = gps_off + ifd_size(&gps);
+	set_pointer(&ifd0,0x8769,exif_off);
+	set_pointer(&ifd0,0x8825,gps_off);
+	set_pointer(&ifd0,0x111,strip_off);
+	set_pointer(&exif,0xA005,interop_off);
+
+	put16(&raw,endian);
+	put16(&raw,42);
+	put32(&raw,8);
+	put_ifd(&raw,&ifd0,0);
+	put_ifd(&raw,&exif,0);
+	put_ifd(&raw,&interop,0);
+	put_ifd(&raw,&gps,0);
+	put_random(&raw,image);
+	save(&raw,name);
+
+	free(raw.data);
+	free_ifd(&ifd0);
+	free_ifd(&exif);
+	free_ifd(&interop);
+	free_ifd(&gps);
+}
+
+/*** JPEG ***/
+
+/* segment with random contents */
+static void
+put_segment(BUFF *pb, int marker, U32 len)
+{
+	put16(pb,0xFF00 | marker);
+	put16(pb,len);
+	put_random(pb,len - 2);
+}
+
+/*
+ * baseline JPEG with about 'image' bytes of entropy coded data;
+ * app: 0 = no APPn, 1 = JFIF APP0, 2 = APP0 and Exif APP1 with
+ * a thumbnail (a camera JPEG)
+ */
+static void
+make_jpeg(const char *name, int app, U32 image)
+{
+	BUFF jpg, tiff;
+	IFD ifd0;
+	U32 i, rst;
+	int ch;
+
+	memset(&jpg,0,sizeof(jpg));
+	jpg.endian = BE;
+	put16(&jpg,0xFFD8);
+	if (app >= 1) {
+		put16(&jpg,0xFFE0);
+		put16(&jpg,16);
+		put(&jpg,"JFIF\0\1\1\1\0\110\0\110\0\0",14);
+	}
+	if (app >= 2) {
+		memset(&tiff,0,sizeof(tiff));
+		memset(&ifd0,0,sizeof(ifd0));
+		tiff.endian = ifd0.endian = LE;
+		add_ascii(&ifd0,0x10F,"NIKON CORPORATION");
+		add_ascii(&ifd0,0x110,"COOLPIX 5700");
+		add_ratio(&ifd0,0x11A,1,300,1);
+		add_ratio(&ifd0,0x11B,1,300,1);
+		add_short(&ifd0,0x128,2);
+		add_ascii(&ifd0,0x132,"2005:06:18 14:02:11");
+		add_blob(&ifd0,0xC4A5,16000 + rnd() % 8000);	/* thumbnail-size */
+		put16(&tiff,LE);
+		put16(&tiff,42);
+		put32(&tiff,8);
+		put_ifd(&tiff,&ifd0,0);
+		put16(&jpg,0xFFE1);
+		put16(&jpg,2 + 6 + tiff.size);
+		put(&jpg,"Exif\0",6);
+		put(&jpg,tiff.data,tiff.size);
+		free(tiff.data);
+		free_ifd(&ifd0);
+	}
+	put_segment(&jpg,0xDB,67);			/* DQT */
+	put_segment(&jpg,0xDB,67);
+	put_segment(&jpg,0xC0,17);			/* SOF0 */
+	put_segment(&jpg,0xC4,31);			/* DHT */
+	put_segment(&jpg,0xC4,181);
+	put_segment(&jpg,0xC4,31);
+	put_segment(&jpg,0xC4,181);
+	put_segment(&jpg,0xDD,4);			/* DRI */
+	put_segment(&jpg,0xDA,12);			/* SOS */
+	/* entropy coded data with stuffed 0xFF bytes and restart markers */
+	reserve(&jpg,image + image / 128 + 16);
+	for (rst = 0, i = 0; i < image; i++) {
+		jpg.data[jpg.size++] = ch = rnd() >> 11 & 0xFF;
+		if (ch == 0xFF)
+			jpg.data[jpg.size++] = 0;
+		if (i % 4096 == 4095) {
+			jpg.data[jpg.size++] = 0xFF;
+			jpg.data[jpg.size++] = 0xD0 + rst++ % 8;
+		}
+	}
+	put16(&jpg,0xFFD9);
+	save(&jpg,name);
+	free(jpg.data);
+}
+
+/*** corpus ***/
+
+#define SRCS	(sizeof(src) / sizeof(src[0]))
+#define DSTS	(sizeof(dst) / sizeof(dst[0]))
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		int endian, layout, iso;	/* layout 0 = JPEG source */
+		U32 image;
+	} src[] = {
+		{ "nef_le_ifd0.nef",	LE,	MK_IFD0,	200,	4000000 },
+		{ "nef_le_ifd8.nef",	LE,	MK_IFD8,	0,		4500000 },
+		{ "nef_le_tiff.nef",	LE,	MK_TIFF,	0,		5000000 },
+		{ "nef_be_ifd0.nef",	BE,	MK_IFD0,	0,		4000000 },
+		{ "nef_be_ifd8.nef",	BE,	MK_IFD8,	400,	4500000 },
+		{ "nef_be_tiff.nef",	BE,	MK_TIFF,	800,	5000000 },
+		{ "canon.cr2",			LE,	MK_CANON,	100,	6000000 },
+		{ "sony.arw",			LE,	MK_SONY,	200,	5000000 },
+		{ "pentax.pef",			BE,	MK_AOC,		400,	4500000 },
+		{ "pentax.dng",			LE,	MK_PENTAX,	800,	7000000 },
+		{ "camera.jpg",			0,	0,			0,		1500000 }
+	};
+	static const struct {
+		const char *name;
+		int app;
+		U32 image;
+	} dst[] = {
+		{ "small.jpg",		0,	60000 },
+		{ "small_app0.jpg",	1,	60000 },
+		{ "small_exif.jpg",	2,	60000 },
+		{ "medium.jpg",		0,	700000 },
+		{ "medium_app0.jpg",1,	700000 },
+		{ "medium_exif.jpg",2,	700000 },
+		{ "large.jpg",		0,	3000000 },
+		{ "large_app0.jpg",	1,	3000000 },
+		{ "large_exif.jpg",	2,	3000000 }
+	};
+	char path[1024];
+	FILE *fp;
+	int i, j;
+
+	if (argc != 2) {
+		fputs("Usage: mkcorpus directory\n",stderr);
+		return 1;
+	}
+	outdir = argv[1];
+
+	for (i = 0; i < SRCS; i++)
+		if (src[i].layout)
+			make_raw(src[i].name,src[i].endian,src[i].layout,
+			  src[i].iso,src[i].image);
+		else
+			make_jpeg(src[i].name,2,src[i].image);
+	for (i = 0; i < DSTS; i++)
+		make_jpeg(dst[i].name,dst[i].app,dst[i].image);
+
+	/* every source with every destination, see cpexif --batch */
+	sprintf(path,"%s/pairs.txt",outdir);
+	if ( (fp = fopen(path,"w")) == 0) {
+		perror(path);
+		return 1;
+	}
+	for (i = 0; i < SRCS; i++)
+		for (j = 0; j < DSTS; j++)
+			fprintf(fp,"%s\t%s\n",src[i].name,dst[j].name);
+	if (fclose(fp)) {
+		perror(path);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * mncheck - checks that the MakerNote of a RAW file was copied to a
+ * JPEG file with its offsets relocated
+ *
+ * Usage: mncheck source destination
+ *
+ * The MakerNote directory is found in both files independently of
+ * cpexif, by the headers the vendors use (see the layouts in
+ * mkcorpus). Every entry must be the same in both files, and every
+ * value stored outside of an entry must be found at the (relocated)
+ * offset of the destination entry. The exit status is 1 if anything
+ * differs or cannot be found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned long U32;
+
+#define BE	0x4D4D
+#define LE	0x4949
+
+#define TAG_EXIF		0x8769
+#define TAG_MAKERNOTE	0x927C
+
+/* a file in memory with its TIFF header */
+typedef struct {
+	const char *name;
+	unsigned char *data;
+	size_t size;
+	size_t tiff;				/* offset of the TIFF header */
+	int endian;
+} FILEDATA;
+
+/* a MakerNote directory and the base of its offsets */
+typedef struct {
+	size_t ifd, base;			/* file offsets */
+	int endian;
+} NOTE;
+
+static const unsigned int type_size[13] = {
+	0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8
+};
+
+static void
+fail(const char *msg, const char *arg)
+{
+	fprintf(stderr,"mncheck: %s '%s'\n",msg,arg);
+	exit(1);
+}
+
+static unsigned int
+get16(int endian, const unsigned char *p)
+{
+	return endian == LE ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static U32
+get32(int endian, const unsigned char *p)
+{
+	return endian == LE ?
+	  get16(LE,p) | (U32)get16(LE,p + 2) << 16 :
+	  (U32)get16(BE,p) << 16 | get16(BE,p + 2);
+}
+
+/* byte order mark, 0 = none */
+static int
+mark(const unsigned char *p)
+{
+	unsigned int val;
+
+	val = get16(BE,p);
+	return val == BE || val == LE ? val : 0;
+}
+
+static void
+load(FILEDATA *pf, const char *name)
+{
+	FILE *fp;
+	long size;
+
+	pf->name = name;
+	if ( (fp = fopen(name,"rb")) == 0 || fseek(fp,0,SEEK_END)
+	  || (size = ftell(fp)) < 0 || fseek(fp,0,SEEK_SET))
+		fail("cannot read",name);
+	pf->size = size;
+	if ( (pf->data = malloc(pf->size + 1)) == 0)
+		fail("cannot allocate memory for",name);
+	if (fread(pf->data,1,pf->size,fp) != pf->size)
+		fail("cannot read",name);
+	fclose(fp);
+}
+
+/* a TIFF file, or the EXIF data in the APP1 segment of a JPEG file */
+static void
+find_tiff(FILEDATA *pf)
+{
+	size_t pos, len;
+	int marker;
+
+	if (pf->size >= 8 && (pf->endian = mark(pf->data))) {
+		pf->tiff = 0;
+		return;
+	}
+	if (pf->size < 4 || get16(BE,pf->data) != 0xFFD8)
+		fail("not a TIFF or JPEG file",pf->name);
+	for (pos = 2; pos + 4 <= pf->size; pos += 2 + len) {
+		marker = get16(BE,pf->data + pos);
+		len = get16(BE,pf->data + pos + 2);
+		if (marker == 0xFFDA || (marker & 0xFF00) != 0xFF00)
+			break;
+		if (marker == 0xFFE1 && len >= 16 && pos + 2 + len <= pf->size
+		  && memcmp(pf->data + pos + 4,"Exif\0\0",6) == 0
+		  && (pf->endian = mark(pf->data + pos + 10))) {
+			pf->tiff = pos + 10;
+			return;
+		}
+	}
+	fail("no EXIF data in",pf->name);
+}
+
+/* exit value: file offset of the entry with the tag */
+static size_t
+find_entry(FILEDATA *pf, size_t ifd, int endian, unsigned int tag)
+{
+	size_t entries, i, entry;
+
+	if (ifd + 2 > pf->size)
+		fail("bad IFD offset in",pf->name);
+	entries = get16(endian,pf->data + ifd);
+	for (i = 0; i < entries; i++) {
+		entry = ifd + 2 + 12 * i;
+		if (entry + 12 > pf->size)
+			fail("truncated IFD in",pf->name);
+		if (get16(endian,pf->data + entry) == tag)
+			return entry;
+	}
+	fprintf(stderr,"mncheck: no tag %X in '%s'\n",tag,pf->name);
+	exit(1);
+}
+
+static void
+find_note(FILEDATA *pf, NOTE *pn)
+{
+	const unsigned char *mn;
+	size_t entry, start, size;
+	int endian;
+
+	find_tiff(pf);
+	endian = pf->endian;
+	entry = find_entry(pf,pf->tiff + get32(endian,pf->data + pf->tiff + 4),
+	  endian,TAG_EXIF);
+	entry = find_entry(pf,pf->tiff + get32(endian,pf->data + entry + 8),
+	  endian,TAG_MAKERNOTE);
+	size = get32(endian,pf->data + entry + 4);
+	start = pf->tiff + get32(endian,pf->data + entry + 8);
+	if (size < 18 || start + size > pf->size)
+		fail("bad MakerNote in",pf->name);
+	mn = pf->data + start;
+
+	pn->endian = endian;
+	pn->base = pf->tiff;
+	if (memcmp(mn,"Nikon\0",6) == 0 && mark(mn + 10)
+	  && get16(mark(mn + 10),mn + 12) == 42) {
+		pn->endian = mark(mn + 10);
+		pn->base = start + 10;
+		pn->ifd = start + 10 + get32(pn->endian,mn + 14);
+	}
+	else if (memcmp(mn,"Nikon\0",6) == 0)
+		pn->ifd = start + 8;
+	else if (memcmp(mn,"SONY DSC \0\0\0",12) == 0
+	  || memcmp(mn,"SONY CAM \0\0\0",12) == 0)
+		pn->ifd = start + 12;
+	else if (memcmp(mn,"AOC\0",4) == 0) {
+		if (mark(mn + 4))
+			pn->endian = mark(mn + 4);
+		pn->ifd = start + 6;
+	}
+	else if (memcmp(mn,"PENTAX \0",8) == 0) {
+		if (mark(mn + 8))
+			pn->endian = mark(mn + 8);
+		pn->base = start;
+		pn->ifd = start + 10;
+	}
+	else
+		pn->ifd = start;
+	if (pn->ifd + 2 > start + size)
+		fail("bad MakerNote in",pf->name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	FILEDATA src, dst;
+	NOTE sn, dn;
+	const unsigned char *se, *de;
+	size_t entries, i, len, soff, doff;
+	unsigned int type;
+
+	if (argc != 3) {
+		fputs("Usage: mncheck source destination\n",stderr);
+		return 1;
+	}
+	load(&src,argv[1]);
+	load(&dst,argv[2]);
+	find_note(&src,&sn);
+	find_note(&dst,&dn);
+	if (sn.endian != dn.endian)
+		fail("MakerNote byte order changed in",dst.name);
+
+	entries = get16(sn.endian,src.data + sn.ifd);
+	if (get16(dn.endian,dst.data + dn.ifd) != entries
+	  || sn.ifd + 2 + 12 * entries > src.size
+	  || dn.ifd + 2 + 12 * entries > dst.size)
+		fail("MakerNote directory differs in",dst.name);
+	for (i = 0; i < entries; i++) {
+		se = src.data + sn.ifd + 2 + 12 * i;
+		de = dst.data + dn.ifd + 2 + 12 * i;
+		if (memcmp(se,de,8))
+			fail("MakerNote entry differs in",dst.name);
+		type = get16(sn.endian,se + 2);
+		len = type < 13 ? type_size[type] * get32(sn.endian,se + 4) : 0;
+		if (len <= 4) {
+			if (memcmp(se + 8,de + 8,4))
+				fail("MakerNote value differs in",dst.name);
+			continue;
+		}
+		soff = sn.base + get32(sn.endian,se + 8);
+		doff = dn.base + get32(dn.endian,de + 8);
+		if (soff + len > src.size || doff + len > dst.size)
+			fail("MakerNote offset out of the file in",dst.name);
+		if (memcmp(src.data + soff,dst.data + doff,len)) {
+			fprintf(stderr,"mncheck: MakerNote tag %X not relocated "
+			  "in '%s'\n",get16(sn.endian,se),dst.name);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,231 @@
+#!/bin/sh
+#
+# smoke - runs the benchmark corpus (see mkcorpus) through every mode
+# of cpexif and compares the results with the single pair mode
+#
+# Usage: smoke.sh cpexif corpus_directory [client [mncheck]]
+#
+# Each pair of 'pairs.txt' writes to its own copies of the destination
+# in the 'smoke' subdirectory of the corpus. The single pair results are
+# checked against the known-good ones listed in 'smoke.ref' and, if the
+# mncheck program is given, for relocated MakerNote offsets. The server
+# mode is checked only if the client program is given. The directory is
+# removed if all checks pass, the exit status is 1 if any check failed.
+
+if [ $# -lt 2 ] || [ $# -gt 4 ]; then
+	echo "Usage: smoke.sh cpexif corpus_directory [client [mncheck]]" >&2
+	exit 1
+fi
+bench=`dirname "$0"`
+reffile=`cd "$bench" && pwd`/smoke.ref
+case $1 in
+	/*)	cpexif=$1 ;;
+	*)	cpexif=`pwd`/$1 ;;
+esac
+client=
+case $3 in
+	'')	;;
+	/*)	client=$3 ;;
+	*)	client=`pwd`/$3 ;;
+esac
+mncheck=
+case $4 in
+	'')	;;
+	/*)	mncheck=$4 ;;
+	*)	mncheck=`pwd`/$4 ;;
+esac
+cd "$2" || exit 1
+
+checks=0
+failed=0
+
+fail()
+{
+	echo "FAILED: $*"
+	failed=`expr $failed + 1`
+}
+
+# same FILE1 FILE2 WHAT
+same()
+{
+	checks=`expr $checks + 1`
+	cmp -s "$1" "$2" || fail "$3: $2 differs from $1"
+}
+
+# dump without the source name
+dump()
+{
+	"$cpexif" --dump "$1" | sed 's/^{"source":"[^"]*"//'
+}
+
+rm -rf smoke
+mkdir smoke smoke/ref smoke/raw smoke/jpg smoke/cache || exit 1
+# files older than the stamp must not have been touched
+touch -t 200001010000 smoke/stamp
+
+# the reference results: one pair per run, checked against the
+# known-good ones and for relocated MakerNote offsets
+n=0
+known=0
+: > smoke/pairs.txt
+: > smoke/requests.txt
+while read src dst; do
+	case $src in
+		''|'#'*)	continue ;;
+	esac
+	n=`expr $n + 1`
+	cp "$dst" smoke/ref/$n.jpg
+	"$cpexif" "$src" smoke/ref/$n.jpg || fail "single: $src smoke/ref/$n.jpg"
+	expect=`awk -F'	' -v s="$src" -v d="$dst" \
+	  '$1 == s && $2 == d { print $3, $4 }' "$reffile"`
+	if [ -n "$expect" ]; then
+		known=`expr $known + 1`
+		checks=`expr $checks + 1`
+		got=`cksum < smoke/ref/$n.jpg | awk '{ print $1, $2 }'`
+		[ "$got" = "$expect" ] \
+		  || fail "known-good: $src $dst gives $got, not $expect"
+	fi
+	case $src in
+		*.jpg)	;;
+		*)	if [ -n "$mncheck" ]; then
+				checks=`expr $checks + 1`
+				"$mncheck" "$src" smoke/ref/$n.jpg \
+				  || fail "MakerNote: $src smoke/ref/$n.jpg"
+			fi ;;
+	esac
+	for mode in batch jobs cache1 cache2 serve; do
+		cp "$dst" smoke/$mode.$n.jpg
+	done
+	printf '%s\tsmoke/batch.%d.jpg\n' "$src" $n >> smoke/pairs.txt
+	printf '%s\tsmoke/serve.%d.jpg\n' "$src" $n >> smoke/requests.txt
+	case $src in
+		*.jpg)	;;
+		*)	ext=`echo "$src" | sed 's/.*\.//'`
+			cp "$src" smoke/raw/$n.$ext
+			cp "$dst" smoke/jpg/$n.jpg ;;
+	esac
+done < pairs.txt
+if [ $n -eq 0 ]; then
+	echo "smoke: no pairs in $2/pairs.txt" >&2
+	exit 1
+fi
+checks=`expr $checks + 1`
+[ $known -eq `grep -c -v '^#' "$reffile"` ] \
+  || fail "known-good: only $known pairs of $reffile found"
+
+# pipe, copy-back, several destinations, unchanged destination, in place
+i=0
+while read src dst; do
+	case $src in
+		''|'#'*)	continue ;;
+	esac
+	i=`expr $i + 1`
+	ref=smoke/ref/$i.jpg
+	"$cpexif" "$src" - < "$dst" > smoke/pipe.$i.jpg
+	same $ref smoke/pipe.$i.jpg pipe
+	cp "$dst" smoke/copyback.$i.jpg
+	"$cpexif" --copyback "$src" smoke/copyback.$i.jpg
+	same $ref smoke/copyback.$i.jpg copyback
+	cp "$dst" smoke/multi1.$i.jpg
+	cp "$dst" smoke/multi2.$i.jpg
+	"$cpexif" "$src" smoke/multi1.$i.jpg smoke/multi2.$i.jpg
+	same $ref smoke/multi1.$i.jpg "several destinations"
+	same $ref smoke/multi2.$i.jpg "several destinations"
+	cp $ref smoke/again.$i.jpg
+	touch -t 199901010000 smoke/again.$i.jpg
+	"$cpexif" "$src" smoke/again.$i.jpg
+	same $ref smoke/again.$i.jpg unchanged
+	checks=`expr $checks + 1`
+	[ -z "`find smoke/again.$i.jpg -newer smoke/stamp`" ] \
+	  || fail "unchanged: smoke/again.$i.jpg touched"
+	cp "$dst" smoke/inplace.$i.jpg
+	"$cpexif" --inplace "$src" smoke/inplace.$i.jpg
+	dump $ref > smoke/dump.ref
+	dump smoke/inplace.$i.jpg > smoke/dump.inplace
+	same smoke/dump.ref smoke/dump.inplace inplace
+	dump "$src" > smoke/dump.src
+	same smoke/dump.ref smoke/dump.src dump
+done < pairs.txt
+
+# batch, parallel batch, cold and warm cache
+"$cpexif" --batch smoke/pairs.txt > /dev/null
+sed 's/batch\./jobs./' smoke/pairs.txt \
+  | "$cpexif" --jobs 4 --batch - > /dev/null
+sed 's/batch\./cache1./' smoke/pairs.txt \
+  | "$cpexif" --jobs 4 --cache smoke/cache --batch - > /dev/null
+sed 's/batch\./cache2./' smoke/pairs.txt \
+  | "$cpexif" --jobs 4 --cache smoke/cache --batch - > /dev/null
+i=1
+while [ $i -le $n ]; do
+	for mode in batch jobs cache1 cache2; do
+		same smoke/ref/$i.jpg smoke/$mode.$i.jpg $mode
+	done
+	i=`expr $i + 1`
+done
+
+# a failed pair gives the same exit status in every mode
+status()
+{
+	checks=`expr $checks + 1`
+	"$@" > /dev/null 2>&1
+	rv=$?
+	[ $rv -eq 2 ] || fail "exit status $rv, not 2: $*"
+}
+printf 'smoke/missing.nef\tsmoke/missing.jpg\n' > smoke/missing.txt
+status "$cpexif" smoke/missing.nef smoke/missing.jpg
+status "$cpexif" --dump smoke/missing.nef
+status "$cpexif" --batch smoke/missing.txt
+status "$cpexif" --jobs 4 --batch smoke/missing.txt
+
+# recursive N WHAT: N = expected number of processed files
+recursive()
+{
+	"$cpexif" --jobs 4 --stats --recursive smoke/raw smoke/jpg \
+	  > /dev/null 2> smoke/stats
+	for file in smoke/jpg/*.jpg; do
+		same smoke/ref/`basename $file` $file "$2"
+	done
+	checks=`expr $checks + 1`
+	tail -1 smoke/stats | grep "^{\"files\":$1," > /dev/null \
+	  || fail "$2: `tail -1 smoke/stats`"
+}
+
+# the second run skips the done files whatever their time stamps are,
+# and leaves them untouched
+jpegs=`ls smoke/jpg | wc -l | tr -d ' '`
+recursive $jpegs recursive
+touch -t 200001010000 smoke/raw/*
+touch -t 199901010000 smoke/jpg/*
+recursive 0 "recursive again"
+checks=`expr $checks + 1`
+[ -z "`find smoke/jpg -type f -newer smoke/stamp`" ] \
+  || fail "recursive again: done destinations touched"
+touch smoke/raw/*
+recursive 0 "recursive, newer sources"
+
+# server
+if [ -n "$client" ]; then
+	"$cpexif" --jobs 4 --serve smoke/socket &
+	server=$!
+	i=0
+	while [ ! -S smoke/socket ] && [ $i -lt 50 ]; do
+		sleep 0.1
+		i=`expr $i + 1`
+	done
+	"$client" smoke/socket smoke/requests.txt > /dev/null 2> smoke/client.log \
+	  || fail "serve: `cat smoke/client.log`"
+	kill -TERM $server
+	wait $server || fail "serve: exit status $?"
+	i=1
+	while [ $i -le $n ]; do
+		same smoke/ref/$i.jpg smoke/serve.$i.jpg serve
+		i=`expr $i + 1`
+	done
+fi
+
+echo "smoke: $n pairs, $checks checks, $failed failed"
+if [ $failed -gt 0 ]; then
+	exit 1
+fi
+rm -rf smoke
+exit 0
@@ -0,0 +1,267 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "arena.h"
+#include "cache.h"
+
+#define NAME_LEN	16				/* entry name: 16 hex digits */
+#define TMP_PREFIX	".tmp."			/* temporary file: .tmp.XXXXXX */
+#define TMP_LEN		11
+#define TMP_STALE	3600			/* seconds, left by a crashed process */
+#define SCAN_PUTS	256				/* puts between scans, other processes
+									   write to the directory too */
+#define EVICT_LOW	90				/* percent of the limit left by evict() */
+
+/* an entry found by evict() */
+typedef struct {
+	time_t mtime;
+	unsigned long size;
+	char name[NAME_LEN + 1];
+} ENTRY;
+
+/*
+ * mkstemp() creates the entries for the owner only, other users
+ * sharing the directory get what the umask allows; the umask cannot
+ * be read without setting it, so it is read once, by the first
+ * cache_open() which comes before any threads are started
+ */
+static mode_t
+entry_mode(void)
+{
+	static int known = 0;
+	static mode_t mode;
+	mode_t mask;
+
+	if (!known) {
+		mask = umask(0);
+		umask(mask);
+		mode = 0666 & ~mask;
+		known = 1;
+	}
+	return mode;
+}
+
+/* exit value: 0 = error (errno is set) */
+CACHE *
+cache_open(const char *dir, unsigned long max_size)
+{
+	CACHE *pc;
+	struct stat st;
+
+	if (mkdir(dir,0777) < 0 && errno != EEXIST)
+		return 0;
+	if (stat(dir,&st) < 0)
+		return 0;
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return 0;
+	}
+	if ( (pc = malloc(sizeof(CACHE))) == 0
+	  || (pc->dir = malloc(strlen(dir) + 1)) == 0) {
+		free(pc);
+		errno = ENOMEM;
+		return 0;
+	}
+	if ( (pc->path = malloc(strlen(dir) + NAME_LEN + 2)) == 0) {
+		free(pc->dir);
+		free(pc);
+		errno = ENOMEM;
+		return 0;
+	}
+	strcpy(pc->dir,dir);
+	pc->mode = entry_mode();
+	pc->max_size = max_size;
+	pc->total = 0;
+	pc->puts = SCAN_PUTS;		/* the first put scans the directory */
+	return pc;
+}
+
+void
+cache_close(CACHE *pc)
+{
+	if (pc == 0)
+		return;
+	free(pc->dir);
+	free(pc->path);
+	free(pc);
+}
+
+/* the entry name is made of two 32-bit hashes of the key */
+static void
+entry_path(CACHE *pc, const char *key)
+{
+	unsigned long h1, h2;
+	int ch;
+
+	h1 = 5381;
+	h2 = 2166136261UL;
+	while ( (ch = *key++ & 0xFF) ) {
+		h1 = (h1 * 33 + ch) & 0xFFFFFFFF;
+		h2 = ((h2 ^ ch) * 16777619UL) & 0xFFFFFFFF;
+	}
+	sprintf(pc->path,"%s/%08lx%08lx",pc->dir,h1,h2);
+}
+
+/*
+ * the entry file contains the key and a newline followed by the data;
+ * a different key under the same name is a miss
+ *
+ * exit value: the data stored in the arena, 0 = not found
+ */
+const char *
+cache_get(CACHE *pc, const char *key, ARENA *arena, size_t *len)
+{
+	FILE *fp;
+	struct stat st;
+	size_t klen, size;
+	char *data;
+
+	entry_path(pc,key);
+	if ( (fp = fopen(pc->path,"rb")) == 0)
+		return 0;
+	data = 0;
+	klen = strlen(key) + 1;
+	if (fstat(fileno(fp),&st) == 0 && st.st_size > klen
+	  && st.st_size <= klen + CACHE_DATA_MAX) {
+		size = st.st_size;
+		data = arena_alloc(arena,size);
+		if (fread(data,1,size,fp) != size
+		  || memcmp(data,key,klen - 1) || data[klen - 1] != '\n')
+			data = 0;
+	}
+	fclose(fp);
+	if (data == 0)
+		return 0;
+	/* the modification time is the time of the last use */
+	utime(pc->path,0);
+	*len = size - klen;
+	return data + klen;
+}
+
+static int
+cmp_age(const void *a, const void *b)
+{
+	time_t ta, tb;
+
+	ta = ((const ENTRY *)a)->mtime;
+	tb = ((const ENTRY *)b)->mtime;
+	return ta < tb ? -1 : ta > tb;
+}
+
+/*
+ * remove stale temporary files, even without a size limit, and the
+ * least recently used entries; an oversized directory is cut below
+ * the limit, so that the next puts do not need to scan it again
+ */
+static void
+evict(CACHE *pc)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	ENTRY *entry, *new;
+	int i, entries, alloc;
+	unsigned long long total, low;
+	time_t now;
+
+	pc->puts = 0;
+	if ( (dir = opendir(pc->dir)) == 0)
+		return;
+	entry = 0;
+	entries = alloc = 0;
+	total = 0;
+	now = time(0);
+	while ( (de = readdir(dir)) ) {
+		if (strncmp(de->d_name,TMP_PREFIX,strlen(TMP_PREFIX)) == 0) {
+			if (strlen(de->d_name) != TMP_LEN)
+				continue;
+			sprintf(pc->path,"%s/%s",pc->dir,de->d_name);
+			if (stat(pc->path,&st) == 0 && now - st.st_mtime > TMP_STALE)
+				remove(pc->path);
+			continue;
+		}
+		if (pc->max_size == 0)
+			continue;	/* the entries are only counted for the limit */
+		if (strlen(de->d_name) != NAME_LEN
+		  || strspn(de->d_name,"0123456789abcdef") != NAME_LEN)
+			continue;
+		sprintf(pc->path,"%s/%s",pc->dir,de->d_name);
+		if (stat(pc->path,&st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (entries == alloc) {
+			alloc = alloc ? 2 * alloc : 256;
+			if ( (new = realloc(entry,alloc * sizeof(ENTRY))) == 0)
+				break;
+			entry = new;
+		}
+		entry[entries].mtime = st.st_mtime;
+		entry[entries].size = st.st_size;
+		strcpy(entry[entries++].name,de->d_name);
+		total += st.st_size;
+	}
+	closedir(dir);
+
+	if (pc->max_size && total > pc->max_size) {
+		low = (unsigned long long)pc->max_size * EVICT_LOW / 100;
+		qsort(entry,entries,sizeof(ENTRY),cmp_age);
+		/* an entry removed by another process counts as removed */
+		for (i = 0; i < entries && total > low; i++) {
+			sprintf(pc->path,"%s/%s",pc->dir,entry[i].name);
+			remove(pc->path);
+			total -= entry[i].size;
+		}
+	}
+	free(entry);
+	pc->total = total;
+}
+
+/*
+ * the entry is written to a temporary file first, the readers see
+ * either the complete old entry or the complete new one; errors are
+ * ignored, the cache is only an optimization
+ */
+void
+cache_put(CACHE *pc, const char *key, const char *data, size_t len)
+{
+	FILE *fp;
+	char *tmp;
+	int fd, ok;
+
+	if (len > CACHE_DATA_MAX)
+		return;
+	if ( (tmp = malloc(strlen(pc->dir) + TMP_LEN + 2)) == 0)
+		return;
+	sprintf(tmp,"%s/%sXXXXXX",pc->dir,TMP_PREFIX);
+	if ( (fd = mkstemp(tmp)) < 0) {
+		free(tmp);
+		return;
+	}
+	fchmod(fd,pc->mode);
+	if ( (fp = fdopen(fd,"wb")) == 0) {
+		close(fd);
+		remove(tmp);
+		free(tmp);
+		return;
+	}
+	ok = fprintf(fp,"%s\n",key) > 0 && fwrite(data,1,len,fp) == len;
+	if (fclose(fp) != 0)
+		ok = 0;
+	entry_path(pc,key);
+	if (!ok || rename(tmp,pc->path) < 0) {
+		remove(tmp);
+		free(tmp);
+		return;
+	}
+	free(tmp);
+	pc->total += strlen(key) + 1 + len;
+	if ((pc->max_size && pc->total > pc->max_size) || ++pc->puts >= SCAN_PUTS)
+		evict(pc);
+}
@@ -0,0 +1,25 @@
+#include "prefix.h"
+
+/*
+ * directory cache of data built from source files: one file per key,
+ * entries are created by rename() and the least recently used ones
+ * are removed when the total size exceeds the limit; the directory
+ * can be shared by several processes, also of other users
+ */
+typedef struct {
+	char *dir;
+	mode_t mode;				/* permissions of the entries */
+	unsigned long max_size;		/* bytes, 0 = no limit */
+	char *path;					/* file name buffer */
+	/* the directory is scanned only when it may have grown too large */
+	unsigned long long total;	/* estimated size, bytes */
+	int puts;					/* entries written since the scan */
+} CACHE;
+
+/* longer data is not cached */
+#define CACHE_DATA_MAX	65536
+
+extern CACHE *cache_open(const char *, unsigned long);
+extern void cache_close(CACHE *);
+extern const char *cache_get(CACHE *, const char *, ARENA *, size_t *);
+extern void cache_put(CACHE *, const char *, const char *, size_t);
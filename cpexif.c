@@ -12,65 +12,33 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+/* parallel jobs and the server mode */
+#if !defined(WIN32) && !defined(NO_THREADS) \
+  && defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+#define HAVE_THREADS
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
 
-#include "cpexif.h"
 #include "fail.h"
-#include "inout.h"
+#include "libcpexif.h"
 #include "options.h"
-
-/* JPG -> JPG mode variables */
-static char *app1 = 0;		/* JPEG APP1 segment without first 12B */
-static U16 app1_len = 0;	/* length of the APP1 segment */
-
-/* NEF -> JPG mode variables and definitions */
-#define IFD_SIZE	12
-
-#define TYPE_ASCII		2
-#define TYPE_USHORT		3
-#define TYPE_ULONG		4
-#define TYPE_URATIO		5
-
-#define TAG_IFD0_MAKE		0x010F
-#define TAG_IFD0_EXIF		0x8769
-#define TAG_IFD0_GPS		0x8825
-#define TAG_EXIF_ISO		0x8827
-#define TAG_EXIF_MAKERNOTE	0x927C
-#define TAG_EXIF_INTEROP	0xA005
-#define TAG_NIKON_ISO		0x2
-#define TAG_NIKON_ISOCODE	0x6
-
-typedef struct ifd_entry {
-	short int valid;		/* flag */
-	char raw[IFD_SIZE];		/* literal 12 bytes */
-	U16 tag, type;
-	U32 count;
-	char *data;				/* -> value */
-	size_t data_size;		/* in bytes */
-	U32 where;				/* offset in the output file */
-	struct ifd_entry *next;	/* linked list */
-} IFD_ENTRY;
-
-/* sizes of one data element of certain IFD type */
-static int memreq[] = { 0,1,1,2,4,8,1,1,2,4,8,4,8 };
-
-static IFD_ENTRY *ifd0, *exif, *gps = 0, *interop = 0;
-static IFD_ENTRY *makernote_field;
-static U32 offset_zero;	/* offset of TIFF header in output file */
-
-/* general variables */
-static int endian;			/* TIFF structure endian */
-static const char *cleanup_file = 0;
-
-static void
-cleanup(void)
-{
-	if (cleanup_file)
-		remove(cleanup_file);
-}
+#include "pool.h"
 
 static void *
 emalloc(size_t size)
@@ -83,517 +51,1237 @@ emalloc(size_t size)
 	return mem;
 }
 
-static IFD_ENTRY *
-new_entry(U16 tag, U16 type, U32 count)
+/* CPEXIF_xxx flags according to the command line options */
+static int
+option_flags(void)
 {
-	IFD_ENTRY *new;
+	return (nomakernote ? CPEXIF_NOMAKERNOTE : 0)
+	  | (noisofix ? CPEXIF_NOISOFIX : 0)
+	  | (copyback ? CPEXIF_COPYBACK : 0)
+	  | (keeptime ? CPEXIF_KEEPTIME : 0)
+	  | (inplace ? CPEXIF_INPLACE : 0)
+	  | (stripgps ? CPEXIF_STRIPGPS : 0)
+	  | (page_cache == PAGE_CACHE_NORMAL ? CPEXIF_NOADVICE : 0)
+	  | (page_cache == PAGE_CACHE_DROP ? CPEXIF_DROPCACHE : 0)
+	  | (verify == VERIFY_SCAN ? CPEXIF_VERIFY : 0)
+	  | (verify == VERIFY_CRC ? CPEXIF_VERIFYCRC : 0);
+}
 
-	assert(type >= 1 && type <= 12);
+/* exit value: 0 = error, described in msg */
+static CPEXIF_JOB *
+create_job(int flags, char *msg, size_t size)
+{
+	CPEXIF_JOB *job;
+	int i, ok;
 
-	new = emalloc(sizeof(IFD_ENTRY));
-	new->valid = 1;
-	store_16b(endian,new->raw    ,new->tag   = tag);
-	store_16b(endian,new->raw + 2,new->type  = type);
-	store_32b(endian,new->raw + 4,new->count = count);
-	store_32b(endian,new->raw + 8,0);
-	new->data_size = count * memreq[type];
-	new->data = new->data_size <= 4 ?
-	  new->raw + 8 : emalloc(new->data_size);
-	return new;
+	if ( (job = cpexif_new(flags)) == 0) {
+		snprintf(msg,size,"Could not allocate memory for a new job");
+		return 0;
+	}
+	ok = cache_dir == 0
+	  || cpexif_set_cache(job,cache_dir,cache_size << 20) == CPEXIF_OK;
+	for (i = 0; ok && i < tag_options; i++)
+		ok = cpexif_filter_tag(job,tag_option[i].ifd,tag_option[i].tag,
+		  tag_option[i].keep) == CPEXIF_OK;
+	if (!ok) {
+		snprintf(msg,size,"%s",cpexif_error(job));
+		cpexif_free(job);
+		return 0;
+	}
+	return job;
 }
 
-static IFD_ENTRY *
-find_entry(U16 tag, U16 type /* 0 = any type */, IFD_ENTRY *pifd)
+static CPEXIF_JOB *
+new_job(int flags)
 {
-	for (; pifd; pifd = pifd->next) {
-		if (!pifd->valid)
-			continue;
-		if (pifd->tag == tag && (type == 0 || pifd->type == type))
-			return pifd;
-		if (pifd->tag > tag)
-			break;
-	}
-	return 0;
+	CPEXIF_JOB *job;
+	char msg[512];
+
+	if ( (job = create_job(flags,msg,sizeof(msg))) == 0)
+		fail_prog("%s",msg);
+	return job;
+}
+
+static void
+print_warnings(CPEXIF_JOB *job)
+{
+	int warnings;
+
+	warnings = cpexif_warnings(job);
+	if (warnings & CPEXIF_WARN_OPTIONS)
+		fputs("WARNING: command line options ignored "
+		  "in the JPEG to JPEG copy mode.\n",stderr);
+	if (warnings & CPEXIF_WARN_NOISO)
+		fputs("WARNING: Cannot find the ISO value.\n"
+		  "Consider running CPEXIF with the --noisofix option.\n",
+		  stderr);
+}
+
+/*** --stats: JSON lines on stderr ***/
+
+/* counters and phase times of a job */
+typedef struct {
+	CPEXIF_STATS io;
+	double timing[CPEXIF_PHASES];
+} STATS;
+
+static const char *phase_name[CPEXIF_PHASES] = {
+	"parse", "build", "copy", "finish"
+};
+
+static double
+wall_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double)time(0);
+#endif
+}
+
+static void
+get_stats(CPEXIF_JOB *job, STATS *st)
+{
+	cpexif_stats(job,&st->io);
+	memcpy(st->timing,cpexif_timing(job),sizeof(st->timing));
+}
+
+/* st += add * sign */
+static void
+sum_stats(STATS *st, const STATS *add, int sign)
+{
+	int i;
+
+	st->io.reads += sign * add->io.reads;
+	st->io.bytes_read += sign * add->io.bytes_read;
+	st->io.writes += sign * add->io.writes;
+	st->io.bytes_written += sign * add->io.bytes_written;
+	st->io.seeks += sign * add->io.seeks;
+	st->io.allocs += sign * add->io.allocs;
+	st->io.bytes_alloc += sign * add->io.bytes_alloc;
+	for (i = 0; i < CPEXIF_PHASES; i++)
+		st->timing[i] += sign * add->timing[i];
+}
+
+static void
+json_string(FILE *fp, const char *str)
+{
+	int ch;
+
+	putc('"',fp);
+	while ( (ch = *str++ & 0xFF) )
+		if (ch == '"' || ch == '\\')
+			fprintf(fp,"\\%c",ch);
+		else if (ch < 0x20)
+			fprintf(fp,"\\u%04x",ch);
+		else
+			putc(ch,fp);
+	putc('"',fp);
 }
 
+/* print the members of a JSON object and close it */
 static void
-insert_entry(IFD_ENTRY *entry, IFD_ENTRY *list)
-{
-	while (list->next &&
-	  (list->next->valid == 0 || list->next->tag < entry->tag))
-		list = list->next;
-	entry->next = list->next;
-	list->next = entry;
-}
-
-static IFD_ENTRY *
-parse_directory(U32 start)
-{
-	U32 offset;
-	U16 i, entries;
-	IFD_ENTRY *pifd, *first, *prev;
-
-	set_read_pos(SEEK_SET,start);
-	if ( (entries = read_16b(endian) ) == 0)
-		fail_prog("Empty IFD structure encountered");
-	first = prev = emalloc(sizeof(IFD_ENTRY));
-	first->valid = 0;	/* dummy to simplify insert operations */
-	for (i = 0; i < entries; i++) {
-		prev->next = pifd = emalloc(sizeof(IFD_ENTRY));
-		pifd->valid = 1;
-		pifd->next = 0;
-		read_from_file(pifd->raw,IFD_SIZE);
-		pifd->tag   = convert_16b(endian,pifd->raw);
-		pifd->type  = convert_16b(endian,pifd->raw + 2);
-		pifd->count = convert_32b(endian,pifd->raw + 4);
-		if (pifd->type < 1 || pifd->type > 12)
-			fail_prog("IFD entry with tag %X has invalid type %d",
-			  pifd->tag,pifd->type);
-		prev = pifd;
+json_stats(FILE *fp, const STATS *st)
+{
+	int i;
+
+	fprintf(fp,"\"reads\":%lu,\"bytes_read\":%lu,"
+	  "\"writes\":%lu,\"bytes_written\":%lu,\"seeks\":%lu,"
+	  "\"allocs\":%lu,\"bytes_alloc\":%lu",
+	  st->io.reads,st->io.bytes_read,st->io.writes,st->io.bytes_written,
+	  st->io.seeks,st->io.allocs,st->io.bytes_alloc);
+	for (i = 0; i < CPEXIF_PHASES; i++)
+		fprintf(fp,",\"%s_ms\":%.3f",phase_name[i],st->timing[i] * 1e3);
+	fputs("}\n",fp);
+}
+
+/*
+ * one line per pair, or per source with --dump (dst = 0);
+ * the lines of parallel jobs are not mixed
+ */
+static void
+print_stats(CPEXIF_JOB *job, const STATS *before,
+  const char *src, const char *dst, int rv)
+{
+	STATS st;
+
+	get_stats(job,&st);
+	sum_stats(&st,before,-1);
+#ifdef HAVE_THREADS
+	flockfile(stderr);
+#endif
+	fputs("{\"source\":",stderr);
+	json_string(stderr,src);
+	if (dst) {
+		fputs(",\"destination\":",stderr);
+		json_string(stderr,dst);
 	}
-	/* start_of_the_next_ifd = read_32b(endian); */
+	fprintf(stderr,",\"status\":\"%s\",",rv < 0 ? "failed"
+	  : cpexif_warnings(job) & CPEXIF_WARN_UNCHANGED ? "unchanged" : "ok");
+	json_stats(stderr,&st);
+#ifdef HAVE_THREADS
+	funlockfile(stderr);
+#endif
+}
 
-	for (pifd = first->next; pifd; pifd = pifd->next) {
-		pifd->data_size = pifd->count * memreq[pifd->type];
-		if (pifd->data_size <= 4)
-			pifd->data = pifd->raw + 8;
-		else {
-			pifd->data = emalloc(pifd->data_size);
-			offset = convert_32b(endian,pifd->raw + 8);
-			set_read_pos(SEEK_SET,offset);
-			read_from_file(pifd->data,pifd->data_size);
+/*
+ * the source is loaded only once for all its destinations
+ *
+ * exit value: 0 = OK, -1 = error (already reported)
+ */
+static int
+process_pair(CPEXIF_JOB *job, const char *src, char *const *dst, int dsts)
+{
+	STATS before;
+	int i, loaded, rv, errors;
+
+	if (stats)
+		get_stats(job,&before);
+	if ( (loaded = cpexif_load_file(job,src) == CPEXIF_OK) )
+		print_warnings(job);
+	else
+		fprintf(stderr,"%s\n",cpexif_error(job));
+	errors = 0;
+	for (i = 0; i < dsts; i++) {
+		rv = -1;
+		/* '-' = read the JPEG from stdin, write the result to stdout */
+		if (loaded && (strcmp(dst[i],"-") ? cpexif_write_file(job,dst[i])
+		  : cpexif_write_stream(job,stdin,stdout)) == CPEXIF_OK)
+			rv = 0;
+		if (rv < 0) {
+			if (loaded)
+				fprintf(stderr,"%s\n",cpexif_error(job));
+			errors++;
+		}
+		if (stats) {
+			print_stats(job,&before,src,dst[i],rv);
+			get_stats(job,&before);
 		}
 	}
+	return errors ? -1 : 0;
+}
 
-	return first;
+/*
+ * --dump: one JSON line per source on stdout
+ *
+ * exit value: 0 = OK, -1 = error (reported in the line)
+ */
+static int
+dump_source(CPEXIF_JOB *job, const char *src)
+{
+	STATS before;
+	const char *json;
+	size_t len;
+	int rv;
+
+	if (stats)
+		get_stats(job,&before);
+	rv = cpexif_load_file(job,src) == CPEXIF_OK
+	  && cpexif_dump(job,&json,&len) == CPEXIF_OK ? 0 : -1;
+#ifdef HAVE_THREADS
+	flockfile(stdout);
+#endif
+	fputs("{\"source\":",stdout);
+	json_string(stdout,src);
+	if (rv < 0) {
+		fputs(",\"error\":",stdout);
+		json_string(stdout,cpexif_error(job));
+	}
+	else {
+		putc(',',stdout);
+		fwrite(json,1,len,stdout);
+	}
+	fputs("}\n",stdout);
+#ifdef HAVE_THREADS
+	funlockfile(stdout);
+#endif
+	if (stats)
+		print_stats(job,&before,src,0,rv);
+	return rv;
 }
 
+/* source and destination file names, both in one allocation */
+typedef struct {
+	char *src, *dst;
+	int incremental;			/* flag: skip the pair if up to date */
+} PAIR;
+
+static CPEXIF_JOB **worker_job;	/* one job per worker thread */
+static int *worker_errors;		/* number of failed pairs per worker */
+static int *worker_skipped;		/* number of skipped pairs per worker */
+static POOL *pool;				/* 0 = no parallel processing */
+static int pairs;				/* submitted pairs */
+static double batch_start;
+
 static void
-parse_nef(const char *nef_file)
+run_pair(void *arg, int worker)
+{
+	CPEXIF_JOB *job;
+	PAIR *pair;
+	int rv;
+
+	pair = arg;
+	job = worker_job[worker];
+	if (dump) {
+		if (dump_source(job,pair->src) < 0)
+			worker_errors[worker]++;
+		free(pair);
+		return;
+	}
+	if ( (rv = process_pair(job,pair->src,&pair->dst,1)) < 0)
+		worker_errors[worker]++;
+	/*
+	 * a destination which already carries exactly the EXIF data of its
+	 * source was done in a previous run; it was compared with the built
+	 * (or cached) data and left untouched
+	 */
+	if (pair->incremental && rv == 0
+	  && (cpexif_warnings(job) & CPEXIF_WARN_UNCHANGED))
+		worker_skipped[worker]++;
+	else {
+		printf("%s\t%s\t%s\n",rv < 0 ? "FAILED" : "OK",
+		  pair->src,pair->dst);
+		fflush(stdout);
+	}
+	free(pair);
+}
+
+static PAIR *
+new_pair(const char *src, const char *dst, int incremental)
 {
-	IFD_ENTRY *p;
+	PAIR *pair;
 
-	ifd0 = parse_directory(read_32b(endian));
-	if ( (p = find_entry(TAG_IFD0_MAKE,TYPE_ASCII,ifd0)) == 0 ||
-	  (strncmp(p->data,"NIKON",5) && strncmp(p->data,"Nikon",5)))
-		fail_prog("File '%s' was not produced by a Nikon camera,\n"
-		  "manufacturer is '%s'",nef_file,p ? p->data : "<unknown>");
-	if ( (p = find_entry(TAG_IFD0_EXIF,TYPE_ULONG,ifd0)) == 0)
-		fail_prog("No EXIF data found in '%s'",nef_file);
-	exif = parse_directory(convert_32b(endian,p->data));
-	if ( (p = find_entry(TAG_EXIF_INTEROP,TYPE_ULONG,exif)) )
-		 interop = parse_directory(convert_32b(endian,p->data));
-	if ( (p = find_entry(TAG_IFD0_GPS,TYPE_ULONG,ifd0)) )
-		gps = parse_directory(convert_32b(endian,p->data));
+	pair = emalloc(sizeof(PAIR) + strlen(src) + strlen(dst) + 2);
+	pair->src = (char *)(pair + 1);
+	pair->dst = pair->src + strlen(src) + 1;
+	strcpy(pair->src,src);
+	strcpy(pair->dst,dst);
+	pair->incremental = incremental;
+	return pair;
 }
 
+/*
+ * with more than one job the pairs are processed in parallel
+ * and the status lines are printed in order of completion
+ */
 static void
-process_ifd0(void)
-{
-	static U16 allowed_tags[] = {
-		0x10E /* ImageDescription */,	TAG_IFD0_MAKE,
-		0x110 /* Model */,				0x112 /* Orientation */,
-		0x11A /* XResolution */,		0x11B /* Yresolution */,
-		0x128 /* Resolution unit */,	0x131 /* Software */,
-		0x132 /* DateTime */,			0x13B /* Artist */,
-		0x213 /* YCbCrPositioning */,	0x8298 /* Copyright */,
-		TAG_IFD0_EXIF,					TAG_IFD0_GPS,
-		0
-	};
-	U16 tag;
+start_batch(void)
+{
 	int i;
-	IFD_ENTRY *pifd;
 
-	for (pifd = ifd0; pifd; pifd = pifd->next) {
-		if (!pifd->valid)
-			continue;
-		for (i = 0; (tag = allowed_tags[i]); i++)
-			if (pifd->tag == tag)
-				break;
-		if (tag == 0)
-			pifd->valid = 0;
+	worker_job = emalloc(jobs * sizeof(CPEXIF_JOB *));
+	worker_errors = emalloc(jobs * sizeof(int));
+	worker_skipped = emalloc(jobs * sizeof(int));
+	for (i = 0; i < jobs; i++) {
+		worker_job[i] = new_job(option_flags());
+		worker_errors[i] = worker_skipped[i] = 0;
 	}
+	pool = jobs > 1 ? pool_create(jobs) : 0;
+	pairs = 0;
+	batch_start = wall_clock();
+}
 
-	/* mandatory tags: 0x11A, 0x11B, 0x128, 0x213 */
-	for (tag = 0x11A; tag <= 0x11B; tag++)
-		if (find_entry(tag,0,ifd0) == 0) {
-			/* X and Y resolution is 300 */
-			pifd = new_entry(tag,TYPE_URATIO,1);
-			store_32b(endian,pifd->data,300);
-			store_32b(endian,pifd->data + 4,1);
-			insert_entry(pifd,ifd0);
-		}
-	if (find_entry(0x128,0,ifd0) == 0) {
-		/* resolution is in dpi */
-		pifd = new_entry(0x128,TYPE_USHORT,1);
-		store_16b(endian,pifd->data,2);
-		insert_entry(pifd,ifd0);
+static void
+submit_pair(PAIR *pair)
+{
+	pairs++;
+	if (pool)
+		pool_submit(pool,run_pair,pair);
+	else
+		run_pair(pair,0);
+}
+
+/* exit value: number of failed pairs */
+static int
+finish_batch(void)
+{
+	STATS total, st;
+	int i, errors, skipped;
+
+	if (pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
 	}
-	if (find_entry(0x213,0,ifd0) == 0) {
-		/* YCbCrPositioning - the usual value is 2 */
-		pifd = new_entry(0x213,TYPE_USHORT,1);
-		store_16b(endian,pifd->data,2);
-		insert_entry(pifd,ifd0);
+	memset(&total,0,sizeof(total));
+	for (errors = skipped = i = 0; i < jobs; i++) {
+		errors += worker_errors[i];
+		skipped += worker_skipped[i];
+		get_stats(worker_job[i],&st);
+		sum_stats(&total,&st,1);
+		cpexif_free(worker_job[i]);
 	}
+	if (stats) {
+		fprintf(stderr,"{\"files\":%d,\"skipped\":%d,\"failed\":%d,"
+		  "\"elapsed_ms\":%.3f,",pairs - skipped,skipped,errors,
+		  (wall_clock() - batch_start) * 1e3);
+		json_stats(stderr,&total);
+	}
+	free(worker_job);
+	free(worker_errors);
+	free(worker_skipped);
+	return errors;
 }
 
 /*
- * 0 = no or unknown makernote
- * 1 = IFD at offset 0
- * 2 = IFD at offset 8
- * BE = IFD with own TIFF header at offset 10 - big endian
- * LE = IFD with own TIFF header at offset 10 - little endian
+ * manifest format: one pair per line, source and destination
+ * are separated by a TAB, or by spaces if there is no TAB;
+ * with --dump the whole line is a source; empty lines and lines
+ * starting with '#' are ignored
+ *
+ * exit value: number of failed pairs
  */
 static int
-makernote_type(void)
+process_batch(const char *manifest)
+{
+	static char line[8192];
+	FILE *fp;
+	char *src, *dst, *end;
+	const char *sep;
+	int lineno;
+
+	if (strcmp(manifest,"-") == 0)
+		fp = stdin;
+	else if ( (fp = fopen(manifest,"r")) == 0)
+		fail_sys("Cannot open file '%s' for reading",manifest);
+
+	start_batch();
+	for (lineno = 1; fgets(line,sizeof(line),fp); lineno++) {
+		end = line + strlen(line);
+		if (end > line && end[-1] != '\n' && !feof(fp))
+			fail_prog("Line %d in '%s' is too long",lineno,manifest);
+		while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+			*--end = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (dump) {
+			submit_pair(new_pair(line,"",0));
+			continue;
+		}
+		sep = strchr(line,'\t') ? "\t" : " ";
+		src = strtok(line,sep);
+		dst = strtok(0,sep);
+		if (src == 0 || dst == 0 || strtok(0,sep))
+			fail_prog("Line %d in '%s' is not a 'source destination' pair",
+			  lineno,manifest);
+		if (strcmp(dst,"-") == 0)
+			fail_prog("Line %d in '%s': the standard input and output "
+			  "cannot be a destination in the batch mode",lineno,manifest);
+		submit_pair(new_pair(src,dst,0));
+	}
+	if (ferror(fp))
+		fail_sys("Cannot read from file '%s'",manifest);
+	if (fp != stdin)
+		fclose(fp);
+
+	return finish_batch();
+}
+
+/*** --recursive: pairing of RAW and JPEG files by their base names ***/
+
+/* file found in a directory tree */
+typedef struct tree_file {
+	char *path;
+	const char *rel;			/* path relative to the tree root */
+	size_t dir_len;				/* length of the directory part of rel */
+	size_t stem_len;			/* length of the name without extension */
+	int dups;					/* number of sources with the same stem */
+	struct tree_file *next;		/* hash chain */
+} TREE_FILE;
+
+#define HASH_SIZE	65536		/* buckets of the source index */
+
+static const char *raw_ext[] = { "nef", "cr2", "arw", "pef", "dng", 0 };
+static const char *jpeg_ext[] = { "jpg", "jpeg", 0 };
+
+static TREE_FILE *src_index[HASH_SIZE];
+static PAIR **tree_pair;		/* pairs found in the destination walk */
+static int tree_pairs, tree_pair_alloc;
+
+/* length of the name without the extension if it is in the list, else 0 */
+static size_t
+match_ext(const char *name, const char **ext)
 {
-	const char *ptr;
-	U16 val;
+	const char *dot, *a, *b;
 
-	if (makernote_field == 0)
+	if ( (dot = strrchr(name,'.')) == 0 || dot == name)
 		return 0;
-	if (makernote_field->data_size < 18)
+	for (; *ext; ext++) {
+		for (a = dot + 1, b = *ext; *a && tolower((unsigned char)*a) == *b;
+		  a++, b++)
+			;
+		if (*a == '\0' && *b == '\0')
+			return dot - name;
+	}
+	return 0;
+}
+
+static unsigned int
+hash_stem(const char *stem, size_t len)
+{
+	unsigned int hash;
+
+	for (hash = 5381; len > 0; len--)
+		hash = hash * 33 + (unsigned char)*stem++;
+	return hash % HASH_SIZE;
+}
+
+static TREE_FILE *
+new_tree_file(const char *path, size_t root_len, size_t stem_len)
+{
+	TREE_FILE *pf;
+	const char *base;
+
+	pf = emalloc(sizeof(TREE_FILE) + strlen(path) + 1);
+	pf->path = (char *)(pf + 1);
+	strcpy(pf->path,path);
+	pf->rel = pf->path + root_len + 1;
+	base = strrchr(pf->rel,'/');
+	pf->dir_len = base ? base - pf->rel : 0;
+	pf->stem_len = stem_len;
+	pf->dups = 0;
+	pf->next = 0;
+	return pf;
+}
+
+static const char *
+stem_of(const TREE_FILE *pf)
+{
+	return pf->rel + (pf->dir_len ? pf->dir_len + 1 : 0);
+}
+
+/*
+ * call fn() for every file with an extension from the list in the tree,
+ * the directory entry types avoid a stat() call for each file
+ */
+static void
+walk_tree(const char *dir, size_t root_len, const char **ext,
+  void (*fn)(const char *, size_t, size_t))
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	char *path;
+	size_t stem_len;
+	int is_dir;
+
+	if ( (dp = opendir(dir)) == 0)
+		fail_sys("Cannot read directory '%s'",dir);
+	while ( (de = readdir(dp)) ) {
+		if (de->d_name[0] == '.')
+			continue;	/* ., .., and hidden files */
+		path = emalloc(strlen(dir) + strlen(de->d_name) + 2);
+		sprintf(path,"%s/%s",dir,de->d_name);
+#ifdef DT_DIR
+		if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+			is_dir = de->d_type == DT_DIR;
+		else
+#endif
+			/* symbolic links to directories are not followed */
+			is_dir = lstat(path,&st) == 0 && S_ISDIR(st.st_mode);
+		if (is_dir)
+			walk_tree(path,root_len,ext,fn);
+		else if ( (stem_len = match_ext(de->d_name,ext)) )
+			fn(path,root_len,stem_len);
+		free(path);
+	}
+	closedir(dp);
+}
+
+static void
+add_source(const char *path, size_t root_len, size_t stem_len)
+{
+	TREE_FILE *pf, *p;
+	unsigned int hash;
+
+	pf = new_tree_file(path,root_len,stem_len);
+	hash = hash_stem(stem_of(pf),stem_len);
+	for (p = src_index[hash]; p; p = p->next)
+		if (p->stem_len == stem_len
+		  && memcmp(stem_of(p),stem_of(pf),stem_len) == 0) {
+			p->dups++;
+			pf->dups++;
+		}
+	pf->next = src_index[hash];
+	src_index[hash] = pf;
+}
+
+/*
+ * the source for a destination: the one with the same name in the same
+ * relative directory, or the only one with the same name in the tree
+ */
+static TREE_FILE *
+find_source(const TREE_FILE *dst)
+{
+	TREE_FILE *p, *found;
+
+	found = 0;
+	for (p = src_index[hash_stem(stem_of(dst),dst->stem_len)]; p; p = p->next)
+		if (p->stem_len == dst->stem_len
+		  && memcmp(stem_of(p),stem_of(dst),dst->stem_len) == 0) {
+			if (p->dir_len == dst->dir_len
+			  && memcmp(p->rel,dst->rel,dst->dir_len) == 0)
+				return p;
+			found = p;
+		}
+	if (found && found->dups) {
+		fprintf(stderr,"WARNING: more than one source for '%s'.\n",
+		  dst->path);
 		return 0;
-	ptr = makernote_field->data;
-	if (strcmp(ptr,"Nikon"))
-		return 1;
-	val = convert_16b(BE,ptr + 10);
-	if ((val == BE || val == LE) && convert_16b(val,ptr + 12) == 42)
-		return val;
-	return 2;
+	}
+	return found;
+}
+
+static void
+add_destination(const char *path, size_t root_len, size_t stem_len)
+{
+	TREE_FILE *dst, *src;
+
+	dst = new_tree_file(path,root_len,stem_len);
+	if ( (src = find_source(dst)) ) {
+		if (tree_pairs == tree_pair_alloc) {
+			tree_pair_alloc = tree_pair_alloc ? 2 * tree_pair_alloc : 1024;
+			if ( (tree_pair = realloc(tree_pair,
+			  tree_pair_alloc * sizeof(PAIR *))) == 0)
+				fail_prog("Could not allocate %lu bytes of memory",
+				  (unsigned long)(tree_pair_alloc * sizeof(PAIR *)));
+		}
+		tree_pair[tree_pairs++] = new_pair(src->path,dst->path,1);
+	}
+	free(dst);
 }
 
-/* exit value: 0 = OK, -1 = error */
+static size_t
+root_length(const char *dir)
+{
+	size_t len;
+
+	for (len = strlen(dir); len > 1 && dir[len - 1] == '/'; len--)
+		;
+	return len;
+}
+
+/*
+ * every destination JPEG is paired with the source RAW file of the same
+ * name, pairs which are up to date are skipped
+ *
+ * exit value: number of failed pairs
+ */
 static int
-isofix(void)
-{
-	static U16 isocode[] = { 80, 0, 160, 0, 320, 100 };
-	int mktype, mkendian;
-	U16 i, entries, iso, tag, type;
-	U32 cnt;
-	IFD_ENTRY *pifd;
-	const char *ptr;
-	size_t size;
-
-	if (find_entry(TAG_EXIF_ISO,0,exif))
-		return 0;	/* if it is not broken ... */
-
-	mktype = makernote_type();
-	size = makernote_field->data_size;
-	if (mktype == 1 || mktype == 2) {
-		ptr = makernote_field->data;
-		mkendian = endian;
-		if (mktype == 2)
-			ptr += 8;
+process_tree(const char *src_dir, const char *dst_dir)
+{
+	TREE_FILE *pf, *next;
+	char *root;
+	int i, errors;
+
+	/* the directory name without trailing slashes is the path prefix */
+	root = emalloc(strlen(src_dir) + strlen(dst_dir) + 2);
+	strcpy(root,src_dir);
+	root[root_length(src_dir)] = '\0';
+	walk_tree(root,strlen(root),raw_ext,add_source);
+	strcpy(root,dst_dir);
+	root[root_length(dst_dir)] = '\0';
+	walk_tree(root,strlen(root),jpeg_ext,add_destination);
+	free(root);
+
+	/* the destination tree is not modified while it is being read */
+	start_batch();
+	for (i = 0; i < tree_pairs; i++)
+		submit_pair(tree_pair[i]);
+	free(tree_pair);
+	errors = finish_batch();
+
+	for (i = 0; i < HASH_SIZE; i++)
+		for (pf = src_index[i]; pf; pf = next) {
+			next = pf->next;
+			free(pf);
+		}
+	return errors;
+}
+
+/*** --serve: requests from a Unix domain socket ***/
+
+#ifdef HAVE_THREADS
+
+#define REQUEST_MAX		8192	/* longest request line */
+#define QUEUE_PER_JOB	4		/* default queue size per worker */
+#define ANSWER_MAX		65536	/* a client with more unread answers
+								   is not read until it takes them */
+
+/* client connection */
+typedef struct conn {
+	int fd;
+	pthread_mutex_t lock;		/* responses are written by the workers */
+	int pending;				/* requests not answered yet (serve_lock) */
+	int eof;					/* flag: the client sends no more requests */
+	int requests;				/* number of requests received */
+	size_t len;					/* bytes in the buffer */
+	char buff[REQUEST_MAX];
+	/* answers the socket did not take yet, sent by the main loop */
+	char *out;
+	size_t out_len, out_alloc;
+	int gone;					/* flag: the client does not read */
+	struct conn *next;
+} CONN;
+
+/* source and destination file names, both in the same allocation */
+typedef struct {
+	CONN *conn;
+	int num;					/* number of the request in the connection */
+	int flags;					/* CPEXIF_xxx */
+	double received;
+	char *src, *dst;
+} REQUEST;
+
+/* request flags are named after the options */
+static const struct {
+	const char *name;
+	int flag;
+} request_flag[] = {
+	{ "nomakernote",	CPEXIF_NOMAKERNOTE },
+	{ "noisofix",		CPEXIF_NOISOFIX },
+	{ "copyback",		CPEXIF_COPYBACK },
+	{ "keeptime",		CPEXIF_KEEPTIME },
+	{ "inplace",		CPEXIF_INPLACE },
+	{ "strip-gps",		CPEXIF_STRIPGPS },
+	{ "verify",			CPEXIF_VERIFY },
+	{ "verify-crc",		CPEXIF_VERIFYCRC },
+	{ 0,				0 }
+};
+
+static pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER;
+static int serve_flags;			/* flags of all requests */
+static int serve_queued;		/* requests accepted, but not answered */
+static int *worker_flags;		/* flags of the worker jobs */
+static int wake_pipe[2];		/* wakes up the main loop */
+static volatile sig_atomic_t stop_serving = 0;
+
+static void
+wake_up(void)
+{
+	int save_errno;
+
+	save_errno = errno;
+	/* a full pipe is fine, the main loop is awake then */
+	if (write(wake_pipe[1],"",1) < 0)
+		;
+	errno = save_errno;
+}
+
+static void
+stop_handler(int sig)
+{
+	stop_serving = 1;
+	wake_up();
+}
+
+static void
+set_nonblock(int fd)
+{
+	fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * write as much of the data as the socket takes without waiting, the
+ * conn lock is held; a write error means that the client is gone
+ *
+ * exit value: bytes written
+ */
+static size_t
+send_some(CONN *pc, const char *data, size_t len)
+{
+	size_t done;
+	ssize_t rv;
+
+	for (done = 0; done < len && !pc->gone; done += rv)
+		if ( (rv = write(pc->fd,data + done,len - done)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno != EINTR)
+				pc->gone = 1;
+			rv = 0;
+		}
+	return done;
+}
+
+/*
+ * a JSON line; what the socket does not take at once is left to
+ * the main loop, the workers never wait for a slow client; if the
+ * client is gone, the response is lost
+ */
+static void
+answer(REQUEST *req, const char *status, const char *error,
+  const STATS *st)
+{
+	CONN *pc;
+	FILE *fp;
+	char *resp, *new;
+	size_t len, done;
+
+	if ( (fp = open_memstream(&resp,&len)) == 0)
+		return;
+	fprintf(fp,"{\"request\":%d,\"source\":",req->num);
+	json_string(fp,req->src);
+	fputs(",\"destination\":",fp);
+	json_string(fp,req->dst);
+	fprintf(fp,",\"status\":\"%s\"",status);
+	if (error) {
+		fputs(",\"error\":",fp);
+		json_string(fp,error);
 	}
-	else if (mktype == BE || mktype == LE) {
-		mkendian = mktype;
-		ptr = makernote_field->data + 10 +
-		  convert_32b(mkendian,makernote_field->data + 14);
-		if (ptr > makernote_field->data + size)
-			return -1;
+	if (st) {
+		fprintf(fp,",\"elapsed_ms\":%.3f,",
+		  (wall_clock() - req->received) * 1e3);
+		json_stats(fp,st);
 	}
 	else
-		return -1;
+		fputs("}\n",fp);
+	fclose(fp);
 
-	/* ptr = start of makernote IFD */
-	/* mkendian = makernote endian (BE or LE) */
-	iso = 0;
-	entries = convert_16b(mkendian,ptr);
-	if (entries == 0 || IFD_SIZE * entries > size)
-		return -1;
-	for (i = 0, ptr += 2; i < entries; i++, ptr += IFD_SIZE) {
-		tag  = convert_16b(mkendian,ptr);
-		type = convert_16b(mkendian,ptr + 2);
-		cnt  = convert_32b(mkendian,ptr + 4);
-		if (mktype != 2 && tag == TAG_NIKON_ISO &&
-		  type == TYPE_USHORT && (cnt == 1 || cnt == 2)) {
-			iso = convert_16b(mkendian,ptr + (cnt == 1 ? 8 : 10));
-			break;
-		}
-		if (mktype == 2 && tag == TAG_NIKON_ISOCODE &&
-		  type == TYPE_USHORT && cnt == 1) {
-			iso = convert_16b(mkendian,ptr + 8);
-			/* 0 = iso80, 2 = iso160, 4 = iso320, 5 = iso100 */
-			if (iso >= 0 && iso <= 5) {
-				iso = isocode[iso];
-				break;
+	pc = req->conn;
+	pthread_mutex_lock(&pc->lock);
+	/* earlier answers go first */
+	done = pc->out_len ? 0 : send_some(pc,resp,len);
+	if (done < len && !pc->gone) {
+		if (pc->out_len + len - done > pc->out_alloc) {
+			if ( (new = realloc(pc->out,2 * (pc->out_len + len - done)))
+			  == 0) {
+				pc->gone = 1;
+				pthread_mutex_unlock(&pc->lock);
+				free(resp);
+				return;
 			}
+			pc->out = new;
+			pc->out_alloc = 2 * (pc->out_len + len - done);
 		}
+		memcpy(pc->out + pc->out_len,resp + done,len - done);
+		pc->out_len += len - done;
 	}
-	if (iso == 0)
-		return -1;
+	pthread_mutex_unlock(&pc->lock);
+	free(resp);
+}
 
-	pifd = new_entry(TAG_EXIF_ISO,TYPE_USHORT,1);
-	store_16b(endian,pifd->data,iso);
-	insert_entry(pifd,exif);
+/* the main loop sends the rest of the answers */
+static void
+send_answers(CONN *pc)
+{
+	size_t done;
 
-	return 0;
+	pthread_mutex_lock(&pc->lock);
+	done = send_some(pc,pc->out,pc->out_len);
+	if (pc->gone)
+		done = pc->out_len;
+	pc->out_len -= done;
+	memmove(pc->out,pc->out + done,pc->out_len);
+	pthread_mutex_unlock(&pc->lock);
 }
 
-/* exit value: 0 = OK, -1 = error */
-static int
-adjust_makernote(void)
-{
-	int mktype;
-	U32 delta;
-	U16 type, i, entries;
-	char *ptr;
-	size_t size;
-
-	mktype = makernote_type();
-	if (mktype == BE || mktype == LE)
-		return 0;	/* nothing to do */
-	if (mktype == 1)
-		ptr = makernote_field->data;
-	else if (mktype == 2)
-		ptr = makernote_field->data + 8;
+/* bytes of answers waiting for the client */
+static size_t
+answers_left(CONN *pc)
+{
+	size_t len;
+
+	pthread_mutex_lock(&pc->lock);
+	len = pc->gone ? 0 : pc->out_len;
+	pthread_mutex_unlock(&pc->lock);
+	return len;
+}
+
+/* the answered request is released, the main loop may accept more */
+static void
+finish_request(REQUEST *req)
+{
+	pthread_mutex_lock(&serve_lock);
+	serve_queued--;
+	req->conn->pending--;
+	pthread_mutex_unlock(&serve_lock);
+	free(req);
+	wake_up();
+}
+
+static void
+run_request(void *arg, int worker)
+{
+	REQUEST *req;
+	CPEXIF_JOB *job;
+	STATS before, st;
+	const char *status;
+	char msg[512];
+
+	req = arg;
+	/* a job with other flags is replaced, a failed one is retried */
+	if (worker_job[worker] == 0 || worker_flags[worker] != req->flags) {
+		cpexif_free(worker_job[worker]);
+		worker_flags[worker] = req->flags;
+		worker_job[worker] = create_job(req->flags,msg,sizeof(msg));
+	}
+	if ( (job = worker_job[worker]) == 0) {
+		answer(req,"failed",msg,0);
+		finish_request(req);
+		return;
+	}
+	get_stats(job,&before);
+	if (cpexif_load_file(job,req->src) != CPEXIF_OK
+	  || cpexif_write_file(job,req->dst) != CPEXIF_OK)
+		status = "failed";
+	else if (cpexif_warnings(job) & CPEXIF_WARN_UNCHANGED)
+		status = "unchanged";
 	else
-		return -1;
-	size = makernote_field->data_size;
+		status = "ok";
+	get_stats(job,&st);
+	sum_stats(&st,&before,-1);
+	answer(req,status,*status == 'f' ? cpexif_error(job) : 0,&st);
+	finish_request(req);
+}
+
+static REQUEST *
+new_request(CONN *pc, const char *src, const char *dst)
+{
+	REQUEST *req;
 
-	/* offsets in the makernote IFD need to be recalculated */
-	delta = get_write_pos()
-	  - convert_32b(endian,makernote_field->raw + 8) - offset_zero;
-	entries = convert_16b(endian,ptr);
-	if (entries == 0 || IFD_SIZE * entries > size)
+	req = emalloc(sizeof(REQUEST) + strlen(src) + strlen(dst) + 2);
+	req->conn = pc;
+	req->num = ++pc->requests;
+	req->flags = serve_flags;
+	req->received = wall_clock();
+	req->src = (char *)(req + 1);
+	req->dst = req->src + strlen(src) + 1;
+	strcpy(req->src,src);
+	strcpy(req->dst,dst);
+	return req;
+}
+
+/*
+ * request line: "source destination [flags]" separated like in the
+ * manifest, flags are comma separated names of options added to the
+ * command line options
+ *
+ * exit value: 0 = OK, -1 = invalid request
+ */
+static int
+parse_request(CONN *pc, char *line, REQUEST **preq)
+{
+	REQUEST *req;
+	char *src, *dst, *flags, *name;
+	const char *sep;
+	int i, extra;
+
+	sep = strchr(line,'\t') ? "\t" : " ";
+	src = strtok(line,sep);
+	dst = strtok(0,sep);
+	flags = strtok(0,sep);
+	extra = strtok(0,sep) != 0;
+	*preq = req = new_request(pc,src ? src : "",dst ? dst : "");
+	if (src == 0 || dst == 0 || extra || strcmp(dst,"-") == 0)
 		return -1;
-	for (i = 0, ptr += 2; i < entries; i++, ptr += IFD_SIZE) {
-		type  = convert_16b(endian,ptr + 2);
-		if (type < 1 || type > 12)
+	for (name = flags ? strtok(flags,",") : 0; name; name = strtok(0,",")) {
+		for (i = 0; request_flag[i].name
+		  && strcmp(name,request_flag[i].name); i++)
+			;
+		if (request_flag[i].name == 0)
 			return -1;
-		if (convert_32b(endian,ptr + 4) * memreq[type] > 4)
-			store_32b(endian,ptr + 8,
-			  convert_32b(endian,ptr + 8) + delta);
+		req->flags |= request_flag[i].flag;
 	}
+	if (req->flags & CPEXIF_VERIFYCRC)
+		req->flags |= CPEXIF_VERIFY;
 	return 0;
 }
 
+/* complete request lines are submitted while the queue has room */
 static void
-write_ifd(IFD_ENTRY *pifd)
-{
-	U16 cnt;
-	U32 data_offset;
-	IFD_ENTRY *p;
-
-	/* number of entries */
-	for (cnt = 0, p = pifd; p; p = p->next)
-		if (p->valid)
-			cnt++;
-	write_16b(endian,cnt);
-	/* directory */
-	data_offset = get_write_pos() + IFD_SIZE * cnt + 4 - offset_zero;
-	for (p = pifd; p; p = p->next) {
-		if (!p->valid)
+submit_requests(CONN *pc, int queue_max)
+{
+	REQUEST *req;
+	char *line, *end;
+	int room;
+
+	for (line = pc->buff; ; line = end + 1) {
+		pthread_mutex_lock(&serve_lock);
+		room = serve_queued < queue_max;
+		pthread_mutex_unlock(&serve_lock);
+		if (!room || (end = memchr(line,'\n',pc->buff + pc->len - line)) == 0)
+			break;
+		*end = '\0';
+		if (end > line && end[-1] == '\r')
+			end[-1] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
 			continue;
-		p->where = get_write_pos();
-		if (p->data_size <= 4)
-			write_to_file(p->raw,IFD_SIZE);
+		pthread_mutex_lock(&serve_lock);
+		serve_queued++;
+		pc->pending++;
+		pthread_mutex_unlock(&serve_lock);
+		if (parse_request(pc,line,&req) == 0)
+			pool_submit(pool,run_request,req);
 		else {
-			write_to_file(p->raw,IFD_SIZE - 4);
-			write_32b(endian,data_offset);
-			data_offset += p->data_size + p->data_size % 2;
+			answer(req,"invalid","Invalid request",0);
+			finish_request(req);
 		}
 	}
-	/* offset of next IFD */
-	write_32b(endian,0);
-	/* data */
-	for (p = pifd; p; p = p->next)
-		if (p->valid && p->data_size > 4) {
-			if (p->tag == TAG_EXIF_MAKERNOTE && adjust_makernote() < 0)
-				fail_prog("Unknown format of the 'MakerNote' field.\n"
-				  "Consider running CPEXIF "
-				  "with the --nomakernote option");
-			write_to_file(p->data,p->data_size);
-			if (p->data_size % 2)
-				write_8b(0);	/* padding */
-		}
+	pc->len -= line - pc->buff;
+	memmove(pc->buff,line,pc->len);
+	if (pc->len == REQUEST_MAX) {
+		/* the line is too long, the rest cannot be trusted */
+		pc->len = 0;
+		pc->eof = 1;
+	}
 }
 
+/*
+ * on shutdown the complete request lines which were read but not
+ * submitted are answered, the client must not wait for them
+ */
 static void
-fill_addr(U16 tag, IFD_ENTRY *directory)
+refuse_requests(CONN *pc)
 {
-	U32 offset;
-	IFD_ENTRY *pifd;
-
-	pifd = find_entry(tag,0,directory);
-	assert(pifd != 0);
+	REQUEST *req;
+	char *line, *end;
 
-	offset = get_write_pos() - offset_zero;
-	set_write_pos(SEEK_SET,pifd->where + 8);
-	write_32b(endian,offset);
-	set_write_pos(SEEK_END,0);
+	for (line = pc->buff;
+	  (end = memchr(line,'\n',pc->buff + pc->len - line)); line = end + 1) {
+		*end = '\0';
+		if (end > line && end[-1] == '\r')
+			end[-1] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		parse_request(pc,line,&req);
+		answer(req,"shutdown","The server is shutting down",0);
+		free(req);
+	}
+	pc->len = 0;
 }
 
 static void
-create_jpeg(const char *jpeg_in)
-{
-	U32 len32;
-	U16 segment, len;
-	char *jpeg_out;
-
-	len = strlen(jpeg_in);
-	jpeg_out = emalloc(len + 8);
-	strcpy(jpeg_out,jpeg_in);
-	strcpy(jpeg_out + len,".XXXXXX");	/* mk(s)temp() template */
-	open_tmp_output(jpeg_out);
-	cleanup_file = jpeg_out;
-
-	write_16b(BE,0xFFD8);	/* JPEG SOI */
-	write_16b(BE,0xFFE1);	/* JPEG APP1 */
-	write_16b(BE,app1_len);
-	write_to_file("Exif\0",6);			/* EXIF marker */
-	offset_zero = get_write_pos();	/* TIFF header starts here */
-	write_16b(BE,endian);
-	write_16b(endian,42);
-
-	if (app1) {
-		/* JPEG -> JPEG */
-		write_to_file(app1,app1_len - 12);
-	}
-	else {
-		/* NEF -> JPEG */
-		write_32b(endian,8);
-		write_ifd(ifd0);
-		fill_addr(TAG_IFD0_EXIF,ifd0);
-		write_ifd(exif);
-		if (interop) {
-			fill_addr(TAG_EXIF_INTEROP,exif);
-			write_ifd(interop);
-		}
-		if (gps) {
-			fill_addr(TAG_IFD0_GPS,ifd0);
-			write_ifd(gps);
-		}
+read_requests(CONN *pc)
+{
+	ssize_t rv;
 
-		/* fill in APP1 length at file offset 4 */
-		len32 = get_write_pos() - 2;
-		if (len32 > 0xFFFF)
-			fail_prog("The EXIF data block is too large, "
-			  "cannot copy it to a JPEG file.\n"
-			  "Consider running CPEXIF with the --nomakernote option\n"
-			  "in order to reduce the size of the EXIF data block");
-		set_write_pos(SEEK_SET,4);
-		write_16b(BE,(U16)len32 - 2);
-		set_write_pos(SEEK_END,0);
+	if ( (rv = read(pc->fd,pc->buff + pc->len,REQUEST_MAX - pc->len)) < 0
+	  && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (rv <= 0) {
+		pc->eof = 1;
+		/* the last line may be unterminated */
+		if (pc->len > 0 && pc->len < REQUEST_MAX)
+			pc->buff[pc->len++] = '\n';
+		return;
 	}
+	pc->len += rv;
+}
 
-	/* copy the original JPEG */
-	open_input(jpeg_in);
-	if (read_16b(BE) != 0xFFD8)
-		fail_prog("File '%s' is not a JPEG",jpeg_in);
-	for (;;) {
-		while ( (segment = read_8b()) == 0xFF)
-			;
-		if (segment == 01 || (segment >= 0xD0 && segment <= 0xD7)) {
-			write_8b(0xFF);
-			write_8b(segment);
-			continue;
-		}
-		if ((len = read_16b(BE)) < 2)
-			fail_prog("JPEG File '%s' is corrupted",jpeg_in);
-		if (segment == 0xE0 || segment == 0xE1) {
-			set_read_pos(SEEK_CUR,len - 2);	/* skip APP0 and/or APP1 */
-			continue;
-		}
-		write_8b(0xFF);
-		write_8b(segment);
-		write_16b(BE,len);
-		if (segment == 0xD9 /* EOI */)
-			fail_prog("There is no image data in '%s'",jpeg_in);
-		if (segment == 0xDA /* SOS */) {
-			copy_till_eof();
-			break;
-		}
-		else
-			copy_data(len - 2);
-	}
-	close_input();
-	close_output();
-	cleanup_file = 0;
+/* a socket file left by a server which is not running is replaced */
+static int
+open_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd, probe;
 
-	/* copy data to preserve the file ownership */
-	open_output(jpeg_in);
-	open_input(jpeg_out);
-	copy_till_eof();
-	close_input();
-	close_output();
-	remove(jpeg_out);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fail_prog("Socket name '%s' is too long",path);
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+	if ( (fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0)
+		fail_sys("Cannot create a socket");
+	if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+		if (errno != EADDRINUSE)
+			fail_sys("Cannot bind socket '%s'",path);
+		if ( (probe = socket(AF_UNIX,SOCK_STREAM,0)) < 0)
+			fail_sys("Cannot create a socket");
+		if (connect(probe,(struct sockaddr *)&addr,sizeof(addr)) == 0)
+			fail_prog("Another server is running on socket '%s'",path);
+		close(probe);
+		if (remove(path) < 0 || bind(fd,(struct sockaddr *)&addr,
+		  sizeof(addr)) < 0)
+			fail_sys("Cannot bind socket '%s'",path);
+	}
+	if (listen(fd,SOMAXCONN) < 0)
+		fail_sys("Cannot listen on socket '%s'",path);
+	set_nonblock(fd);
+	return fd;
 }
 
+/*
+ * the main loop reads requests and hands them over to the workers,
+ * the workers send the responses; connections are not read while
+ * the queue is full; SIGINT and SIGTERM stop accepting requests,
+ * the server exits when the accepted ones are answered
+ */
 static void
-parse_jpg(const char *filename)
+serve(const char *path)
 {
-	U16 segment, len, id;
+	struct sigaction sa;
+	struct pollfd *pfd;
+	CONN *conns, *pc, **ppc;
+	char drain[64];
+	size_t left;
+	int i, n, fd, listen_fd, queue_max, stopping, pending, room;
 
-	for (;/* until return or break */;) {
-		if (read_8b() != 0xFF)
-			fail_prog("JPEG file '%s' is corrupted",filename);
-		segment = read_8b();
-		if (segment == 01 || (segment >= 0xD0 && segment <= 0xD7))
-			continue;
-		if (segment == 0xD9 /* EOI */ || segment == 0xDA /* SOS */)
+	queue_max = queue_size ? queue_size : QUEUE_PER_JOB * jobs;
+	listen_fd = open_socket(path);
+	if (pipe(wake_pipe) < 0)
+		fail_sys("Cannot create a pipe");
+	set_nonblock(wake_pipe[0]);
+	set_nonblock(wake_pipe[1]);
+	memset(&sa,0,sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT,&sa,0);
+	sigaction(SIGTERM,&sa,0);
+	/* write errors of gone clients are ignored */
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE,&sa,0);
+
+	worker_job = emalloc(jobs * sizeof(CPEXIF_JOB *));
+	worker_flags = emalloc(jobs * sizeof(int));
+	/* the files are read: a file truncated meanwhile cannot raise SIGBUS */
+	serve_flags = option_flags() | CPEXIF_NOMAP;
+	for (i = 0; i < jobs; i++)
+		worker_job[i] = new_job(worker_flags[i] = serve_flags);
+	pool = pool_create(jobs);
+
+	conns = 0;
+	pfd = 0;
+	stopping = 0;
+	for (;;) {
+		if (stop_serving && !stopping) {
+			stopping = 1;
+			close(listen_fd);
+			remove(path);
+			for (pc = conns; pc; pc = pc->next)
+				refuse_requests(pc);
+		}
+		for (ppc = &conns; (pc = *ppc); ) {
+			if (!stopping)
+				submit_requests(pc,queue_max);
+			pthread_mutex_lock(&serve_lock);
+			pending = pc->pending;
+			pthread_mutex_unlock(&serve_lock);
+			/*
+			 * all requests of a closed connection must be submitted
+			 * and answered, and the answers sent
+			 */
+			if (((pc->eof && pc->len == 0) || stopping) && pending == 0
+			  && answers_left(pc) == 0) {
+				*ppc = pc->next;
+				close(pc->fd);
+				pthread_mutex_destroy(&pc->lock);
+				free(pc->out);
+				free(pc);
+			}
+			else
+				ppc = &pc->next;
+		}
+		if (stopping && conns == 0)
 			break;
-		if ((len = read_16b(BE)) < 2)
-			fail_prog("JPEG File '%s' is corrupted",filename);
-		if (segment == 0xE1 /* APP1 */ && len >= 16 &&
-		  read_32b(BE) == 0x45786966 && read_16b(BE) == 0 &&
-		  ((id = read_16b(BE)) == BE || id == LE) &&
-		   read_16b(id) == 42) {
-			/* Exif\0\0 + TIFF header */
-			endian = id;
-			app1_len = len;
-			app1 = emalloc(app1_len - 12);
-			read_from_file(app1,app1_len - 12);
-			return;
+
+		for (n = 2, pc = conns; pc; pc = pc->next)
+			n++;
+		free(pfd);
+		pfd = emalloc(n * sizeof(struct pollfd));
+		pthread_mutex_lock(&serve_lock);
+		room = serve_queued < queue_max;
+		pthread_mutex_unlock(&serve_lock);
+		pfd[0].fd = wake_pipe[0];
+		pfd[1].fd = stopping ? -1 : listen_fd;
+		for (i = 0; i < 2; i++)
+			pfd[i].events = POLLIN;
+		/*
+		 * back-pressure: the clients wait in write() while the queue
+		 * is full or their answers are not taken; a connection with
+		 * nothing to do is left out, as a client which hung up would
+		 * report POLLHUP at once and make the loop spin
+		 */
+		for (n = 2, pc = conns; pc; pc = pc->next, n++) {
+			left = answers_left(pc);
+			pfd[n].fd = pc->fd;
+			pfd[n].events = left ? POLLOUT : 0;
+			if (!stopping && !pc->eof && room && left < ANSWER_MAX)
+				pfd[n].events |= POLLIN;
+			if (pfd[n].events == 0)
+				pfd[n].fd = -1;
+		}
+		if (poll(pfd,n,-1) < 0) {
+			if (errno != EINTR)
+				fail_sys("Cannot wait for requests");
+			continue;
+		}
+		while (read(wake_pipe[0],drain,sizeof(drain)) > 0)
+			;
+		for (n = 2, pc = conns; pc; pc = pc->next, n++) {
+			if (pfd[n].fd < 0 || pfd[n].revents == 0)
+				continue;
+			/* a client which hung up takes no answers any more */
+			if (pfd[n].revents & (POLLHUP | POLLERR)) {
+				pthread_mutex_lock(&pc->lock);
+				pc->gone = 1;
+				pthread_mutex_unlock(&pc->lock);
+			}
+			if (pfd[n].events & POLLOUT)
+				send_answers(pc);
+			if (pfd[n].events & POLLIN)
+				read_requests(pc);
 		}
-		set_read_pos(SEEK_CUR,len - 2);
+		if (pfd[1].fd >= 0 && pfd[1].revents)
+			while ( (fd = accept(listen_fd,0,0)) >= 0) {
+				set_nonblock(fd);
+				pc = emalloc(sizeof(CONN));
+				pc->fd = fd;
+				pthread_mutex_init(&pc->lock,0);
+				pc->pending = pc->eof = pc->requests = pc->gone = 0;
+				pc->len = pc->out_len = pc->out_alloc = 0;
+				pc->out = 0;
+				pc->next = conns;
+				conns = pc;
+			}
 	}
-	fail_prog("No EXIF data found in '%s'",filename);
+	free(pfd);
+	pool_wait(pool);
+	pool_destroy(pool);
+	for (i = 0; i < jobs; i++)
+		cpexif_free(worker_job[i]);
+	free(worker_job);
+	free(worker_flags);
 }
 
+#else
+
 static void
-process_input(const char *file)
+serve(const char *path)
 {
-	U16 id;
-
-	open_input(file);
-	id = read_16b(BE);
-	if (id == 0xFFD8) {
-		parse_jpg(file);
-		if (noisofix || nomakernote)
-			fputs("WARNING: command line options ignored "
-			  "in the JPEG to JPEG copy mode.\n",stderr);
-	}
-	else if ((id == BE || id == LE) && read_16b(id) == 42) {
-		endian = id;
-		parse_nef(file);
-		makernote_field = find_entry(TAG_EXIF_MAKERNOTE,0,exif);
-		process_ifd0();
-		if (nomakernote && makernote_field)
-			makernote_field->valid = 0;
-		if (!noisofix && isofix() < 0)
-			fputs("WARNING: Cannot find the ISO value.\n"
-			  "Consider running CPEXIF with the --noisofix option.\n",
-			  stderr);
-	}
-	else
-		fail_prog("File '%s' is not a NEF, TIFF, or JPEG file",file);
-	close_input();
-
+	fail_prog("The server mode is not supported on this system");
 }
 
+#endif
+
 int
 main(int argc, char *argv[])
 {
+	CPEXIF_JOB *job;
 	char **av;
+	int i, dsts, errors;
 
 	av = process_options(argc,argv);
 
 	umask(022);
-	atexit(cleanup);
-	process_input(av[0]);
-	create_jpeg(av[1]);
-
-	return 0;
+	if (batch_file)
+		return process_batch(batch_file) ? 2 : 0;
+	if (recursive)
+		return process_tree(av[0],av[1]) ? 2 : 0;
+	if (serve_path) {
+		serve(serve_path);
+		return 0;
+	}
+	if (dump) {
+		job = new_job(option_flags());
+		for (errors = i = 0; av[i]; i++)
+			if (dump_source(job,av[i]) < 0)
+				errors++;
+		return errors ? 2 : 0;
+	}
+	for (dsts = 0; av[dsts + 1]; dsts++)
+		;
+	return process_pair(new_job(option_flags()),av[0],av + 1,dsts) < 0 ? 2 : 0;
 }
@@ -0,0 +1,97 @@
+#include <stddef.h>
+#include <string.h>
+#ifndef WIN32
+# include <unistd.h>
+#endif
+
+#include "cpexif.h"
+#include "crc.h"
+
+#if !defined(NO_THREADS) && defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+# define HAVE_THREADS
+# include <pthread.h>
+#endif
+
+#define POLY	0x82F63B78UL		/* reflected */
+
+/* slicing-by-8 tables */
+static U32 table[8][256];
+#ifdef HAVE_THREADS
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+#else
+static int table_done = 0;
+#endif
+
+static void
+make_table(void)
+{
+	U32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? crc >> 1 ^ POLY : crc >> 1;
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (crc = table[0][i], j = 1; j < 8; j++)
+			table[j][i] = crc = crc >> 8 ^ table[0][crc & 0xFF];
+}
+
+static U32
+crc_soft(U32 crc, const unsigned char *p, size_t len)
+{
+#ifdef HAVE_THREADS
+	pthread_once(&table_once,make_table);
+#else
+	if (!table_done) {
+		make_table();
+		table_done = 1;
+	}
+#endif
+	for (; len >= 8; p += 8, len -= 8) {
+		crc ^= p[0] | (U32)p[1] << 8 | (U32)p[2] << 16 | (U32)p[3] << 24;
+		crc = table[7][crc & 0xFF] ^ table[6][crc >> 8 & 0xFF]
+		  ^ table[5][crc >> 16 & 0xFF] ^ table[4][crc >> 24 & 0xFF]
+		  ^ table[3][p[4]] ^ table[2][p[5]]
+		  ^ table[1][p[6]] ^ table[0][p[7]];
+	}
+	while (len--)
+		crc = crc >> 8 ^ table[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/* the SSE 4.2 instruction, selected at run time */
+__attribute__((target("sse4.2")))
+static U32
+crc_sse42(U32 crc, const unsigned char *p, size_t len)
+{
+	unsigned long long c, word;
+
+	c = crc;
+	for (; len > 0 && ((size_t)p & 7); len--)
+		c = __builtin_ia32_crc32qi(c,*p++);
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word,p,8);
+		c = __builtin_ia32_crc32di(c,word);
+	}
+	for (; len > 0; len--)
+		c = __builtin_ia32_crc32qi(c,*p++);
+	return c;
+}
+#endif
+
+U32
+crc32c(U32 crc, const void *data, size_t len)
+{
+	crc = ~crc & 0xFFFFFFFF;
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc = crc_sse42(crc,data,len);
+	else
+#endif
+		crc = crc_soft(crc,data,len);
+	return ~crc & 0xFFFFFFFF;
+}
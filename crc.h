@@ -0,0 +1,4 @@
+#include "prefix.h"
+
+/* CRC-32C (Castagnoli), crc = 0 to start, the result continues */
+extern U32 crc32c(U32, const void *, size_t);
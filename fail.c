@@ -1,10 +1,63 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#ifndef WIN32
+# include <unistd.h>
+#endif
 
 #include "fail.h"
 
+#if !defined(NO_THREADS) && defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+static _Thread_local FAIL_TRAP *trap = 0;	/* one per thread */
+#else
+static FAIL_TRAP *trap = 0;
+#endif
+
+/*
+ * install a trap for the calling thread (0 = exit on failure),
+ * return the previous one
+ */
+FAIL_TRAP *
+fail_trap(FAIL_TRAP *new)
+{
+	FAIL_TRAP *old;
+
+	old = trap;
+	trap = new;
+	return old;
+}
+
+/* save_errno < 0 = not a system error */
+static void
+fail(int save_errno, const char *format, va_list argptr)
+{
+	char *msg;
+	size_t len;
+
+	if (trap == 0) {
+		vfprintf(stderr,format,argptr);
+		fputs(".\n",stderr);
+		if (save_errno >= 0) {
+			errno = save_errno;
+			perror("Error");
+		}
+		exit(2);
+	}
+	trap->sys = save_errno >= 0;
+	msg = trap->msg;
+	vsnprintf(msg,sizeof(trap->msg),format,argptr);
+	len = strlen(msg);
+	if (save_errno >= 0)
+		snprintf(msg + len,sizeof(trap->msg) - len,
+		  ".\nError: %s",strerror(save_errno));
+	else
+		snprintf(msg + len,sizeof(trap->msg) - len,".");
+	longjmp(trap->env,1);
+	/* NOT REACHED */
+}
+
 void
 fail_sys(const char *format, ...)
 {
@@ -13,12 +66,7 @@ fail_sys(const char *format, ...)
 
 	save_errno = errno;
 	va_start(argptr,format);
-	vfprintf(stderr,format,argptr);
-	fputs(".\n",stderr);
-	va_end(argptr);
-	errno = save_errno;
-	perror("Error");
-	exit(2);
+	fail(save_errno,format,argptr);
 	/* NOT REACHED */
 }
 
@@ -28,9 +76,6 @@ fail_prog(const char *format, ...)
 	va_list argptr;
 
 	va_start(argptr,format);
-	vfprintf(stderr,format,argptr);
-	fputs(".\n",stderr);
-	va_end(argptr);
-	exit(2);
+	fail(-1,format,argptr);
 	/* NOT REACHED */
 }
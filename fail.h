@@ -1,2 +1,14 @@
+#include <setjmp.h>
+
+#include "prefix.h"
+
+/* a failure trap turns fail_xxx() calls into longjmp() */
+typedef struct fail_trap {
+	jmp_buf env;
+	int sys;				/* 1 = system error, 0 = other error */
+	char msg[512];			/* error message without the final newline */
+} FAIL_TRAP;
+
 extern void fail_sys(const char *, ...);
 extern void fail_prog(const char *, ...);
+extern FAIL_TRAP *fail_trap(FAIL_TRAP *);
@@ -1,158 +1,683 @@
+#ifdef __linux__
+# define _GNU_SOURCE	/* fallocate(), sync_file_range() */
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <utime.h>
+
+/* without mmap() the input files are read with stdio */
+#if !defined(WIN32) && !defined(NO_MMAP) \
+  && defined(_POSIX_MAPPED_FILES) && _POSIX_MAPPED_FILES > 0
+# define HAVE_MMAP
+# include <sys/mman.h>
+#endif
+/* posix_fadvise(), posix_madvise() */
+#if !defined(WIN32) \
+  && defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+# define HAVE_ADVICE
+#endif
+/* POSIX.1-2008: futimens() and nanosecond time stamps, otherwise utime() */
+#if !defined(WIN32) && defined(_POSIX_VERSION) && _POSIX_VERSION >= 200809L
+# define HAVE_FUTIMENS
+#endif
 
 #include "cpexif.h"
 #include "inout.h"
 #include "fail.h"
-
-static FILE *ifp, *ofp;
-static const char *ifile, *ofile;
+#include "uring.h"
 
 /*** input ***/
 
+/* tell the kernel how the input file is going to be used */
+static void
+advise_input(IO *io, int fd, void *map, size_t size)
+{
+#ifdef HAVE_ADVICE
+	if (io->advice & ADVISE_RANDOM) {
+		posix_fadvise(fd,0,0,POSIX_FADV_RANDOM);
+		/* the headers are at the beginning of the file */
+		posix_fadvise(fd,0,ADVISE_HEADER,POSIX_FADV_WILLNEED);
+	}
+	else if (io->advice & ADVISE_SEQUENTIAL)
+		posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+#if defined(HAVE_ADVICE) && defined(HAVE_MMAP)
+	/* page faults of a mapping follow its own hints */
+	if (map == 0)
+		return;
+	if (io->advice & ADVISE_RANDOM) {
+		posix_madvise(map,size,POSIX_MADV_RANDOM);
+		posix_madvise(map,size < ADVISE_HEADER ? size : ADVISE_HEADER,
+		  POSIX_MADV_WILLNEED);
+	}
+	else if (io->advice & ADVISE_SEQUENTIAL)
+		posix_madvise(map,size,POSIX_MADV_SEQUENTIAL);
+#endif
+}
+
+/* the file is not needed anymore, free its pages in the page cache */
+static void
+drop_file(IO *io, int fd)
+{
+#ifdef HAVE_ADVICE
+	if (io->advice & ADVISE_DROP)
+		posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ * first step of open_input(): open the file and get its status from
+ * the descriptor, nothing is read yet; start_input() or close_input()
+ * follows
+ */
+void
+hold_input(IO *io, const char *file, struct stat *st)
+{
+	io->iext = 0;
+	io->ifile = file;
+#ifndef WIN32
+	if ( (io->ifd = open(file,O_RDONLY)) < 0)
+		fail_sys("Cannot open file '%s' for reading",file);
+	io->iheld = 1;
+	if (fstat(io->ifd,st) < 0)
+		fail_sys("Cannot get the status of file '%s'",file);
+#else
+	if ( (io->ifp = fopen(file,"rb")) == 0)
+		fail_sys("Cannot open file '%s' for reading",file);
+	if (fstat(fileno(io->ifp),st) < 0)
+		fail_sys("Cannot get the status of file '%s'",file);
+#endif
+}
+
+/* second step: regular files are memory mapped if possible */
+void
+start_input(IO *io, const struct stat *st)
+{
+#ifndef WIN32
+	int fd;
+#ifdef HAVE_MMAP
+	void *map;
+#endif
+
+	fd = io->ifd;
+#ifdef HAVE_MMAP
+	if (!io->nomap && S_ISREG(st->st_mode) && st->st_size > 0
+	  && (map = mmap(0,st->st_size,PROT_READ,MAP_PRIVATE,fd,0))
+	  != MAP_FAILED) {
+		advise_input(io,fd,map,st->st_size);
+		open_mem_input(io,io->ifile,map,st->st_size);
+		/* the descriptor is kept for drop_file() */
+		io->imapped = 1;
+		io->iheld = 0;
+		io->ifd = fd;
+		return;
+	}
+#endif
+	advise_input(io,fd,0,0);
+	if ( (io->ifp = fdopen(fd,"rb")) == 0)
+		fail_sys("Cannot open file '%s' for reading",io->ifile);
+	io->iheld = 0;
+#endif
+}
+
+void
+open_input(IO *io, const char *file)
+{
+	struct stat st;
+
+	hold_input(io,file,&st);
+	start_input(io,&st);
+}
+
+/* read from a stream opened by the caller, it is not closed */
+void
+open_stream_input(IO *io, const char *name, FILE *fp)
+{
+	io->ifp = fp;
+	io->ifile = name;
+	io->iext = 1;
+}
+
+/* also a descriptor held by hold_input() */
+static void
+unmap_input(IO *io)
+{
+#ifdef HAVE_MMAP
+	if (io->imapped) {
+		munmap((void *)io->imem,io->isize);
+		drop_file(io,io->ifd);
+		close(io->ifd);
+		io->imapped = 0;
+	}
+#endif
+#ifndef WIN32
+	if (io->iheld) {
+		close(io->ifd);
+		io->iheld = 0;
+	}
+#endif
+	io->imem = 0;
+}
+
+/* it is allowed to close an input which is not open */
 void
-open_input(const char *file)
+close_input(IO *io)
 {
-	if ( (ifp = fopen(ifile = file,"rb")) == 0)
-		fail_sys("Cannot open file '%s' for reading",ifile);
+	FILE *fp;
+
+	if ( (fp = io->ifp) == 0) {
+		unmap_input(io);
+		return;
+	}
+	io->ifp = 0;
+	if (io->iext)
+		return;
+	drop_file(io,fileno(fp));
+	if (fclose(fp))
+		fail_sys("Cannot close file '%s'",io->ifile);
 }
 
+/* bytes left in the memory input */
+static size_t
+mem_left(IO *io)
+{
+	return io->ipos < io->isize ? io->isize - io->ipos : 0;
+}
+
+/* read from a buffer instead of a file, no copy is made */
 void
-close_input(void)
+open_mem_input(IO *io, const char *name, const void *buff, size_t size)
+{
+	io->ifp = 0;
+	io->iext = 0;
+	io->ifile = name;
+	io->imem = size ? buff : "";
+	io->isize = size;
+	io->ipos = 0;
+	io->imapped = 0;
+}
+
+/*
+ * direct access to input data without copying,
+ * exit value: 0 = not available (the input is not in memory)
+ */
+const char *
+input_ptr(IO *io, U32 offset, size_t bytes)
 {
-	if (fclose(ifp))
-		fail_sys("Cannot close file '%s'",ifile);
+	if (io->ifp)
+		return 0;
+	if (offset > io->isize || bytes > io->isize - offset)
+		fail_prog("Cannot read from file '%s'.\n"
+		  "Error: End of file is reached",io->ifile);
+	return io->imem + offset;
 }
 
 void
-read_from_file(void *buff, size_t bytes)
+read_from_file(IO *io, void *buff, size_t bytes)
 {
-	if (fread(buff,1,bytes,ifp) != bytes) {
-		if (feof(ifp))
+	io->stats.reads++;
+	io->stats.bytes_read += bytes;
+	if (io->ifp == 0) {
+		if (bytes > mem_left(io))
 			fail_prog("Cannot read from file '%s'.\n"
-			  "Error: End of file is reached",ifile);
-		fail_sys("Cannot read from file '%s'",ifile);
+			  "Error: End of file is reached",io->ifile);
+		memcpy(buff,io->imem + io->ipos,bytes);
+		io->ipos += bytes;
+		return;
+	}
+	if (fread(buff,1,bytes,io->ifp) != bytes) {
+		if (feof(io->ifp))
+			fail_prog("Cannot read from file '%s'.\n"
+			  "Error: End of file is reached",io->ifile);
+		fail_sys("Cannot read from file '%s'",io->ifile);
 	}
 }
 
+/* skip input data without seeking (the input may be a pipe) */
 void
-set_read_pos(int whence, long offset)
+skip_data(IO *io, size_t bytes)
 {
-	if (fseek(ifp,offset,whence) < 0)
-		fail_sys("Cannot set read offset for file '%s'",ifile);
+	size_t chunk;
+
+	if (io->ifp == 0) {
+		if (bytes > mem_left(io))
+			fail_prog("Cannot read from file '%s'.\n"
+			  "Error: End of file is reached",io->ifile);
+		io->ipos += bytes;
+		return;
+	}
+	for (; bytes > 0; bytes -= chunk) {
+		chunk = bytes > COPY_BUFF ? COPY_BUFF : bytes;
+		read_from_file(io,io->copy_buff,chunk);
+	}
+}
+
+/*
+ * read up to 'bytes' bytes from a stdio input,
+ * exit value: number of bytes read, 0 = end of file
+ */
+size_t
+read_some(IO *io, void *buff, size_t bytes)
+{
+	size_t got;
+
+	io->stats.reads++;
+	got = fread(buff,1,bytes,io->ifp);
+	if (ferror(io->ifp))
+		fail_sys("Cannot read from file '%s'",io->ifile);
+	io->stats.bytes_read += got;
+	return got;
+}
+
+void
+set_read_pos(IO *io, int whence, long offset)
+{
+	long pos;
+
+	io->stats.seeks++;
+	if (io->ifp == 0) {
+		pos = offset + (whence == SEEK_SET ? 0 :
+		  whence == SEEK_CUR ? (long)io->ipos : (long)io->isize);
+		if (pos < 0)
+			fail_prog("Cannot set read offset for '%s'",io->ifile);
+		io->ipos = pos;
+		return;
+	}
+	if (fseek(io->ifp,offset,whence) < 0)
+		fail_sys("Cannot set read offset for file '%s'",io->ifile);
+}
+
+U32
+get_read_pos(IO *io)
+{
+	return io->ifp ? ftell(io->ifp) : io->ipos;
 }
 
+/* exit value: size of the input, 0 = unknown */
 U32
-get_read_pos(void)
+input_size(IO *io)
 {
-	return ftell(ifp);
+	struct stat st;
+
+	if (io->ifp == 0)
+		return io->isize;
+	if (fstat(fileno(io->ifp),&st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	return st.st_size;
 }
 
 U32
 convert_32b(int endian, const char *bytes)
 {
-	U32 num;
-	int i;
+	const unsigned char *p;
 
-	for (num = 0, i = 0; i < 4; i++) {
-		num <<= 8;
-		num += bytes[endian == BE ? i : 3 - i] & 0xFF;
-	}
-	return num;
+	p = (const unsigned char *)bytes;
+	return endian == BE ? BE_32B(p) : LE_32B(p);
 }
 
 U16
 convert_16b(int endian, const char *bytes)
 {
-	U16 b0, b1;
+	const unsigned char *p;
 
-	b0 = bytes[0] & 0xFF;
-	b1 = bytes[1] & 0xFF;
-	return endian == BE ? (b0 << 8) + b1 : (b1 << 8) + b0;
+	p = (const unsigned char *)bytes;
+	return endian == BE ? BE_16B(p) : LE_16B(p);
 }
 
 U32
-read_32b(int endian)
+read_32b(IO *io, int endian)
 {
 	char buff[4];
 
-	read_from_file(buff,4);
+	read_from_file(io,buff,4);
 	return convert_32b(endian,buff);
 }
 
 U16
-read_16b(int endian)
+read_16b(IO *io, int endian)
 {
 	char buff[2];
 
-	read_from_file(buff,2);
+	read_from_file(io,buff,2);
 	return convert_16b(endian,buff);
 }
 
 U16
-read_8b(void)
+read_8b(IO *io)
 {
 	char buff;
 
-	read_from_file(&buff,1);
+	read_from_file(io,&buff,1);
 	return buff & 0xFF;
 }
 
 /*** output ****/
 
 void
-open_output(const char *file)
+open_output(IO *io, const char *file)
 {
-	if ( (ofp = fopen(ofile = file,"wb")) == 0)
-		fail_sys("Cannot open file %s for writing",ofile);
+	io->oext = 0;
+	if ( (io->ofp = fopen(io->ofile = file,"wb")) == 0)
+		fail_sys("Cannot open file %s for writing",io->ofile);
 }
 
+/* overwrite an existing file without truncating it */
 void
-open_tmp_output(char *template)
+open_update_output(IO *io, const char *file)
+{
+	io->oext = 0;
+	if ( (io->ofp = fopen(io->ofile = file,"r+b")) == 0)
+		fail_sys("Cannot open file %s for writing",io->ofile);
+}
+
+void
+open_tmp_output(IO *io, char *template)
 {
 #ifdef WIN32
 	/* no mkstemp() */
-	ofile = mktemp(template);
-	if ( (ofp = fopen(ofile, "wb")) == 0)
-		fail_sys("Cannot create temporary file '%s'",ofile);
+	io->oext = 0;
+	io->ofile = mktemp(template);
+	if ( (io->ofp = fopen(io->ofile, "wb")) == 0)
+		fail_sys("Cannot create temporary file '%s'",io->ofile);
 #else
-	int fd;
+	int fd, err;
 
+	io->oext = 0;
 	if ( (fd = mkstemp(template)) < 0)
 		fail_sys("Cannot create temporary file '%s'",template);
-	ofile = template;
-	if ( (ofp = fdopen(fd,"wb")) == 0)
-		fail_sys("Cannot open temporary file '%s' for writing",ofile);
+	io->ofile = template;
+	if ( (io->ofp = fdopen(fd,"wb")) == 0) {
+		err = errno;
+		close(fd);
+		remove(template);
+		errno = err;
+		fail_sys("Cannot open temporary file '%s' for writing",io->ofile);
+	}
+#endif
+}
+
+/*
+ * write to a growing buffer instead of a file; in the scatter mode
+ * data copied from a memory input is not duplicated, the output
+ * is described by a list of spans instead
+ */
+void
+open_mem_output(IO *io, const char *name, int scatter)
+{
+	io->ofp = 0;
+	io->oext = 0;
+	io->ofile = name;
+	io->osize = io->opos = 0;
+	io->scatter = scatter;
+	io->spans = 0;
+}
+
+/* append a span, merge it with the previous one if possible */
+static void
+add_span(IO *io, const char *ext, size_t off, size_t len)
+{
+	SPAN *last;
+
+	if (io->spans > 0) {
+		last = io->span + io->spans - 1;
+		if (ext == 0 && last->ext == 0 && last->off + last->len == off) {
+			last->len += len;
+			return;
+		}
+		if (ext && last->ext && last->ext + last->len == ext) {
+			last->len += len;
+			return;
+		}
+	}
+	if (io->spans == io->span_alloc) {
+		io->span_alloc = io->span_alloc ? 2 * io->span_alloc : 16;
+		count_alloc(io,io->span_alloc * sizeof(SPAN));
+		if ( (io->span = realloc(io->span,
+		  io->span_alloc * sizeof(SPAN))) == 0)
+			fail_prog("Could not allocate %lu bytes of memory",
+			  (unsigned long)(io->span_alloc * sizeof(SPAN)));
+	}
+	last = io->span + io->spans++;
+	last->ext = ext;
+	last->off = off;
+	last->len = len;
+}
+
+static void
+write_to_mem(IO *io, const void *buff, size_t bytes)
+{
+	size_t end;
+
+	end = io->opos + bytes;
+	if (end > io->oalloc) {
+		io->oalloc = end > 2 * io->oalloc ? end : 2 * io->oalloc;
+		count_alloc(io,io->oalloc);
+		if ( (io->omem = realloc(io->omem,io->oalloc)) == 0)
+			fail_prog("Could not allocate %lu bytes of memory",
+			  (unsigned long)io->oalloc);
+	}
+	memcpy(io->omem + io->opos,buff,bytes);
+	if (end > io->osize) {
+		if (io->scatter)
+			add_span(io,0,io->osize,end - io->osize);
+		io->osize = end;
+	}
+	io->opos = end;
+}
+
+/* write to a stream opened by the caller, it is flushed but not closed */
+void
+open_stream_output(IO *io, const char *name, FILE *fp)
+{
+	io->ofp = fp;
+	io->ofile = name;
+	io->oext = 1;
+}
+
+void
+close_output(IO *io)
+{
+	FILE *fp;
+
+	if ( (fp = io->ofp) == 0)
+		return;		/* memory output stays available */
+	io->ofp = 0;
+	if (!io->oext && (io->advice & ADVISE_DROP) && fflush(fp) == 0) {
+#ifdef SYNC_FILE_RANGE_WRITE
+		/* only pages already written to the disk can be dropped */
+		sync_file_range(fileno(fp),0,0,SYNC_FILE_RANGE_WAIT_BEFORE
+		  | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+		drop_file(io,fileno(fp));
+	}
+	if (io->oext ? fflush(fp) : fclose(fp))
+		fail_sys("Cannot close file '%s'",io->ofile);
+}
+
+/* write the output file through to the disk before it replaces another */
+void
+sync_output(IO *io)
+{
+	if (fflush(io->ofp))
+		fail_sys("Cannot write to file '%s'",io->ofile);
+#ifndef WIN32
+	if (fsync(fileno(io->ofp)) < 0)
+		fail_sys("Cannot write file '%s' to the disk",io->ofile);
+#endif
+}
+
+/*
+ * make a rename() into the directory of the file durable; errors are
+ * ignored, not every system can open or sync a directory
+ */
+void
+sync_directory(const char *file)
+{
+#ifndef WIN32
+	const char *slash;
+	char *dir;
+	int fd;
+
+	if ( (slash = strrchr(file,'/')) == 0)
+		fd = open(".",O_RDONLY);
+	else if ( (dir = malloc(slash - file + 2)) == 0)
+		return;
+	else {
+		/* "/name" is in the root directory */
+		memcpy(dir,file,slash - file + 1);
+		dir[slash == file ? 1 : slash - file] = '\0';
+		fd = open(dir,O_RDONLY);
+		free(dir);
+	}
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
 #endif
 }
 
+/*
+ * give the output file the attributes of another file:
+ * ATTR_OWNER = owner, group and permissions, ATTR_TIMES = time stamps
+ *
+ * exit value: 0 = OK, -1 = not possible
+ */
+int
+copy_attributes(IO *io, const struct stat *st, int what)
+{
+#ifdef WIN32
+	return -1;
+#else
+	struct stat out;
+#ifdef HAVE_FUTIMENS
+	struct timespec ts[2];
+#else
+	struct utimbuf ut;
+#endif
+	int fd;
+
+	if (fflush(io->ofp))
+		fail_sys("Cannot write to file '%s'",io->ofile);
+	fd = fileno(io->ofp);
+	if (what & ATTR_OWNER) {
+		if (fstat(fd,&out) < 0)
+			return -1;
+		if ((out.st_uid != st->st_uid || out.st_gid != st->st_gid)
+		  && fchown(fd,st->st_uid,st->st_gid) < 0)
+			return -1;
+		if (fchmod(fd,st->st_mode & 07777) < 0)
+			return -1;
+	}
+	if (what & ATTR_TIMES) {
+#ifdef HAVE_FUTIMENS
+		ts[0] = st->st_atim;
+		ts[1] = st->st_mtim;
+		if (futimens(fd,ts) < 0)
+			return -1;
+#else
+		/* by name, the data has been flushed above */
+		ut.actime = st->st_atime;
+		ut.modtime = st->st_mtime;
+		if (utime(io->ofile,&ut) < 0)
+			return -1;
+#endif
+	}
+	return 0;
+#endif
+}
+
+/*
+ * reserve disk space for the output file which will be written
+ * sequentially; only a hint, the file size is not changed and
+ * errors are ignored
+ */
 void
-close_output(void)
+preallocate_output(IO *io, U32 size)
 {
-	if (fclose(ofp))
-		fail_sys("Cannot close file '%s'",ofile);
+#ifdef __linux__
+	if (io->ofp && size > 0)
+		fallocate(fileno(io->ofp),FALLOC_FL_KEEP_SIZE,0,size);
+#endif
+}
+
+/*
+ * large writes to our own files go through io_uring with several
+ * requests in flight
+ *
+ * exit value: 0 = not done, use stdio
+ */
+static int
+write_uring(IO *io, const void *buff, size_t bytes)
+{
+	long pos, requests;
+	int err;
+
+	if (io->ring == 0 && (io->ring = uring_open()) == 0)
+		return 0;
+	if (fflush(io->ofp) != 0)
+		fail_sys("Cannot write to file '%s'",io->ofile);
+	if ( (pos = ftell(io->ofp)) < 0)
+		return 0;
+	if ( (requests = uring_write(io->ring,fileno(io->ofp),buff,bytes,pos))
+	  < 0) {
+		/* the ring may be unusable, the next file gets a new one */
+		err = errno;
+		uring_close(io->ring);
+		io->ring = 0;
+		errno = err;
+		fail_sys("Cannot write to file '%s'",io->ofile);
+	}
+	if (fseek(io->ofp,pos + bytes,SEEK_SET) < 0)
+		fail_sys("Cannot set write offset for '%s'",io->ofile);
+	io->stats.writes += requests - 1;
+	return 1;
 }
 
 void
-write_to_file(void *buff, size_t bytes)
+write_to_file(IO *io, const void *buff, size_t bytes)
 {
-	if (fwrite(buff,1,bytes,ofp) != bytes)
-		fail_sys("Cannot write to file '%s'",ofile);
+	io->stats.writes++;
+	io->stats.bytes_written += bytes;
+	if (io->ofp == 0) {
+		write_to_mem(io,buff,bytes);
+		return;
+	}
+	if (bytes >= URING_MIN && !io->oext && !io->nouring
+	  && write_uring(io,buff,bytes))
+		return;
+	if (fwrite(buff,1,bytes,io->ofp) != bytes)
+		fail_sys("Cannot write to file '%s'",io->ofile);
 }
 
+/* positions in the memory output count only bytes stored in the buffer */
 void
-set_write_pos(int whence, long offset)
+set_write_pos(IO *io, int whence, long offset)
 {
-	if (fseek(ofp,offset,whence) < 0)
-		fail_sys("Cannot set write offset for '%s'",ofile);
+	long pos;
+
+	io->stats.seeks++;
+	if (io->ofp == 0) {
+		pos = offset + (whence == SEEK_SET ? 0 :
+		  whence == SEEK_CUR ? (long)io->opos : (long)io->osize);
+		if (pos < 0 || pos > io->osize)
+			fail_prog("Cannot set write offset for '%s'",io->ofile);
+		io->opos = pos;
+		return;
+	}
+	if (fseek(io->ofp,offset,whence) < 0)
+		fail_sys("Cannot set write offset for '%s'",io->ofile);
 }
 
 U32
-get_write_pos(void)
+get_write_pos(IO *io)
 {
-	return ftell(ofp);
+	return io->ofp ? ftell(io->ofp) : io->opos;
 }
 
 void
@@ -184,56 +709,105 @@ store_16b(int endian, char *bytes, U16 num)
 }
 
 void
-write_32b(int endian, U32 num)
+write_32b(IO *io, int endian, U32 num)
 {
 	char buff[4];
 
 	store_32b(endian,buff,num);
-	write_to_file(buff,4);
+	write_to_file(io,buff,4);
 }
 
 void
-write_16b(int endian, U16 num)
+write_16b(IO *io, int endian, U16 num)
 {
 	char buff[2];
 
 	store_16b(endian,buff,num);
-	write_to_file(buff,2);
+	write_to_file(io,buff,2);
 }
 
 void
-write_8b(U16 num)
+write_8b(IO *io, U16 num)
 {
 	char buff;
 
 	buff = num & 0xFF;
-	write_to_file(&buff,1);
+	write_to_file(io,&buff,1);
+}
+
+/* close all files after a failure, errors are ignored */
+void
+abort_io(IO *io)
+{
+	if (io->ifp) {
+		if (!io->iext)
+			fclose(io->ifp);
+		io->ifp = 0;
+	}
+	if (io->ofp) {
+		if (!io->oext)
+			fclose(io->ofp);
+		io->ofp = 0;
+	}
+	unmap_input(io);
+	io->osize = io->opos = 0;
+	io->spans = 0;
+}
+
+/* count a memory allocation done on behalf of this I/O */
+void
+count_alloc(IO *io, size_t bytes)
+{
+	io->stats.allocs++;
+	io->stats.bytes_alloc += bytes;
 }
 
 /*** copy ***/
 
-#define COPY_BUFF	16384
-static char copy_buff[COPY_BUFF];
+/* copy from a memory input, no buffering needed */
+static void
+copy_mem(IO *io, size_t bytes)
+{
+	if (bytes == 0)
+		return;
+	if (io->scatter) {
+		io->stats.writes++;
+		io->stats.bytes_written += bytes;
+		add_span(io,io->imem + io->ipos,0,bytes);
+	}
+	else
+		write_to_file(io,io->imem + io->ipos,bytes);
+	io->ipos += bytes;
+}
 
 void
-copy_data(size_t bytes)
+copy_data(IO *io, size_t bytes)
 {
 	size_t chunk;
 
+	if (io->ifp == 0) {
+		if (bytes > mem_left(io))
+			fail_prog("Cannot read from file '%s'.\n"
+			  "Error: End of file is reached",io->ifile);
+		copy_mem(io,bytes);
+		return;
+	}
 	for (; bytes > 0; bytes -= chunk) {
 		chunk = bytes > COPY_BUFF ? COPY_BUFF : bytes;
-		read_from_file(copy_buff,chunk);
-		write_to_file(copy_buff,chunk);
+		read_from_file(io,io->copy_buff,chunk);
+		write_to_file(io,io->copy_buff,chunk);
 	}
 }
 
 void
-copy_till_eof(void)
+copy_till_eof(IO *io)
 {
 	size_t chunk;
 
-	while ( (chunk = fread(copy_buff,1,COPY_BUFF,ifp)) )
-		write_to_file(copy_buff,chunk);
-	if (ferror(ifp))
-		fail_sys("Cannot read from file '%s'",ifile);
+	if (io->ifp == 0) {
+		copy_mem(io,mem_left(io));
+		return;
+	}
+	while ( (chunk = read_some(io,io->copy_buff,COPY_BUFF)) )
+		write_to_file(io,io->copy_buff,chunk);
 }
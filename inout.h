@@ -1,29 +1,114 @@
+#include "prefix.h"
+
 /* big and little endian according to TIFF specification */
 #define BE	0x4D4D
 #define LE	0x4949
 
-extern void open_input(const char *);
-extern void close_input(void);
-extern void read_from_file(void *, size_t);
-extern void set_read_pos(int, long);
-extern U32 get_read_pos(void);
+/* values of a known byte order, p = const unsigned char *, any alignment */
+#define BE_16B(p)	((U16)((p)[0] << 8 | (p)[1]))
+#define LE_16B(p)	((U16)((p)[1] << 8 | (p)[0]))
+#define BE_32B(p)	((U32)(p)[0] << 24 | (U32)(p)[1] << 16 \
+					  | (U32)(p)[2] << 8 | (p)[3])
+#define LE_32B(p)	((U32)(p)[3] << 24 | (U32)(p)[2] << 16 \
+					  | (U32)(p)[1] << 8 | (p)[0])
+
+#define COPY_BUFF	16384
+
+/* file access hints (IO.advice) */
+#define ADVISE_RANDOM		1	/* input: parsed at random offsets */
+#define ADVISE_SEQUENTIAL	2	/* input: read from start to end */
+#define ADVISE_DROP			4	/* drop the file from the page cache
+								   when closed */
+#define ADVISE_HEADER		65536	/* prefetched with ADVISE_RANDOM */
+
+/* copy_attributes() */
+#define ATTR_OWNER	1
+#define ATTR_TIMES	2
+
+struct stat;
+struct uring;
+
+/* part of a scattered memory output */
+typedef struct {
+	const char *ext;			/* data outside the buffer, 0 = in buffer */
+	size_t off, len;			/* off is used only for data in buffer */
+} SPAN;
+
+/* I/O counters, they are never reset */
+typedef struct {
+	unsigned long reads, bytes_read;		/* reads from file or memory */
+	unsigned long writes, bytes_written;
+	unsigned long seeks;					/* set_xxx_pos() calls */
+	unsigned long allocs, bytes_alloc;		/* buffer (re)allocations */
+} IO_STATS;
+
+/*
+ * I/O state of one job, there is one input and one output;
+ * both can be a file or memory (ifp or ofp is 0)
+ */
+typedef struct io {
+	FILE *ifp, *ofp;
+	const char *ifile, *ofile;
+	int iext, oext;				/* flag: ifp/ofp belongs to the caller */
+	/* memory input (also a memory mapped file) */
+	const char *imem;
+	size_t isize, ipos;
+	int imapped;				/* flag: imem is a mapped file */
+	int nomap;					/* flag: never map the file */
+	int ifd;					/* descriptor of the mapped file */
+	int iheld;					/* flag: ifd is open, not used yet */
+	/* memory output */
+	char *omem;
+	size_t osize, opos, oalloc;
+	int scatter;				/* output is described by spans */
+	SPAN *span;
+	int spans, span_alloc;
+	char copy_buff[COPY_BUFF];
+	struct uring *ring;			/* large file writes, 0 = not opened */
+	int nouring;				/* flag: never use the ring */
+	int advice;					/* ADVISE_xxx */
+	IO_STATS stats;
+} IO;
+
+extern void open_input(IO *, const char *);
+extern void hold_input(IO *, const char *, struct stat *);
+extern void start_input(IO *, const struct stat *);
+extern void open_mem_input(IO *, const char *, const void *, size_t);
+extern void open_stream_input(IO *, const char *, FILE *);
+extern void close_input(IO *);
+extern void read_from_file(IO *, void *, size_t);
+extern void skip_data(IO *, size_t);
+extern size_t read_some(IO *, void *, size_t);
+extern const char *input_ptr(IO *, U32, size_t);
+extern void set_read_pos(IO *, int, long);
+extern U32 get_read_pos(IO *);
+extern U32 input_size(IO *);
 extern U32 convert_32b(int, const char *);
 extern U16 convert_16b(int, const char *);
-extern U32 read_32b(int);
-extern U16 read_16b(int);
-extern U16 read_8b(void);
-
-extern void open_output(const char *);
-extern void open_tmp_output(char *);
-extern void close_output(void);
-extern void write_to_file(void *, size_t);
-extern void set_write_pos(int, long);
-extern U32 get_write_pos(void);
+extern U32 read_32b(IO *, int);
+extern U16 read_16b(IO *, int);
+extern U16 read_8b(IO *);
+
+extern void open_output(IO *, const char *);
+extern void open_update_output(IO *, const char *);
+extern void open_tmp_output(IO *, char *);
+extern void open_mem_output(IO *, const char *, int);
+extern void open_stream_output(IO *, const char *, FILE *);
+extern void close_output(IO *);
+extern void sync_output(IO *);
+extern void sync_directory(const char *);
+extern int copy_attributes(IO *, const struct stat *, int);
+extern void preallocate_output(IO *, U32);
+extern void write_to_file(IO *, const void *, size_t);
+extern void set_write_pos(IO *, int, long);
+extern U32 get_write_pos(IO *);
 extern void store_32b(int, char *, U32);
 extern void store_16b(int, char *, U16);
-extern void write_32b(int, U32);
-extern void write_16b(int, U16);
-extern void write_8b(U16);
+extern void write_32b(IO *, int, U32);
+extern void write_16b(IO *, int, U16);
+extern void write_8b(IO *, U16);
+extern void abort_io(IO *);
+extern void count_alloc(IO *, size_t);
 
-extern void copy_data(size_t);
-extern void copy_till_eof(void);
+extern void copy_data(IO *, size_t);
+extern void copy_till_eof(IO *);
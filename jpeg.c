@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpexif.h"
+#include "inout.h"
+#include "jpeg.h"
+#include "fail.h"
+
+/*
+ * pointer to bytes at the given offset; a memory input is accessed
+ * directly, a file is read in large blocks (one read is usually enough
+ * for all segments before the image data)
+ */
+static const unsigned char *
+scan_bytes(IO *io, JPEG_INDEX *idx, U32 off, size_t bytes)
+{
+	if (io->ifp == 0)
+		return (const unsigned char *)input_ptr(io,off,bytes);
+	if (off < idx->boff || off + bytes > idx->boff + idx->blen) {
+		if (idx->buff == 0) {
+			if ( (idx->buff = malloc(JPEG_SCAN_BUFF)) == 0)
+				fail_prog("Could not allocate %lu bytes of memory",
+				  (unsigned long)JPEG_SCAN_BUFF);
+			count_alloc(io,JPEG_SCAN_BUFF);
+		}
+		set_read_pos(io,SEEK_SET,off);
+		idx->boff = off;
+		idx->blen = read_some(io,idx->buff,JPEG_SCAN_BUFF);
+		if (bytes > idx->blen)
+			fail_prog("Cannot read from file '%s'.\n"
+			  "Error: End of file is reached",io->ifile);
+	}
+	return (const unsigned char *)idx->buff + (off - idx->boff);
+}
+
+static void
+add_segment(IO *io, JPEG_INDEX *idx, U16 marker, U32 off, U32 len)
+{
+	JPEG_SEGMENT *ps;
+
+	if (idx->segs == idx->seg_alloc) {
+		idx->seg_alloc = idx->seg_alloc ? 2 * idx->seg_alloc : 32;
+		count_alloc(io,idx->seg_alloc * sizeof(JPEG_SEGMENT));
+		if ( (idx->seg = realloc(idx->seg,
+		  idx->seg_alloc * sizeof(JPEG_SEGMENT))) == 0)
+			fail_prog("Could not allocate %lu bytes of memory",
+			  (unsigned long)(idx->seg_alloc * sizeof(JPEG_SEGMENT)));
+	}
+	ps = idx->seg + idx->segs++;
+	ps->marker = marker;
+	ps->off = off;
+	ps->len = len;
+}
+
+/*
+ * build the segment table of the JPEG input, fill bytes (0xFF)
+ * before a marker are not part of any segment; the read position
+ * is undefined afterwards
+ */
+void
+scan_jpeg(IO *io, JPEG_INDEX *idx)
+{
+	const unsigned char *ptr;
+	U32 pos;
+	U16 marker, len;
+
+	idx->segs = 0;
+	idx->blen = 0;
+	ptr = scan_bytes(io,idx,0,2);
+	if (ptr[0] != 0xFF || ptr[1] != JPEG_SOI)
+		fail_prog("File '%s' is not a JPEG",io->ifile);
+	add_segment(io,idx,JPEG_SOI,0,2);
+	for (pos = 2;;) {
+		if (*scan_bytes(io,idx,pos,1) != 0xFF)
+			fail_prog("JPEG file '%s' is corrupted",io->ifile);
+		while ( (marker = *scan_bytes(io,idx,pos + 1,1)) == 0xFF)
+			pos++;
+		if (marker == JPEG_TEM || (marker >= JPEG_RST0 && marker <= JPEG_RST7)
+		  || marker == JPEG_EOI) {
+			/* standalone marker */
+			add_segment(io,idx,marker,pos,2);
+			if (marker == JPEG_EOI)
+				return;
+			pos += 2;
+			continue;
+		}
+		ptr = scan_bytes(io,idx,pos + 2,2);
+		if ( (len = (ptr[0] << 8) + ptr[1]) < 2)
+			fail_prog("JPEG file '%s' is corrupted",io->ifile);
+		add_segment(io,idx,marker,pos,len + 2);
+		if (marker == JPEG_SOS)
+			return;
+		pos += len + 2;
+	}
+}
+
+void
+free_index(JPEG_INDEX *idx)
+{
+	free(idx->seg);
+	free(idx->buff);
+	idx->seg = 0;
+	idx->buff = 0;
+	idx->segs = idx->seg_alloc = 0;
+	idx->blen = 0;
+}
+
+/* states of the image data check */
+#define V_MARKER	0			/* 0xFF of a marker expected */
+#define V_CODE		1			/* marker code expected */
+#define V_LEN1		2			/* segment length, high byte */
+#define V_LEN2		3			/* segment length, low byte */
+#define V_SKIP		4			/* segment contents */
+#define V_DATA		5			/* entropy coded data */
+#define V_DATA_FF	6			/* 0xFF in the entropy coded data */
+#define V_END		7			/* EOI found, the rest is not checked */
+
+void
+verify_init(JPEG_VERIFY *pv, U32 off)
+{
+	pv->state = V_MARKER;
+	pv->off = off;
+	pv->left = 0;
+	pv->marker = 0;
+	pv->next_rst = 0;
+}
+
+static void
+verify_fail(IO *io, JPEG_VERIFY *pv, const char *problem)
+{
+	fail_prog("JPEG file '%s' is corrupted.\n"
+	  "Error: %s at offset %lu",io->ifile,problem,(unsigned long)pv->off);
+}
+
+/* a marker code after 0xFF outside of the entropy coded data */
+static void
+verify_code(IO *io, JPEG_VERIFY *pv, int code)
+{
+	if (code == 0xFF)
+		return;			/* fill byte */
+	if (code == JPEG_EOI)
+		pv->state = V_END;
+	else if (code == JPEG_TEM)
+		pv->state = V_MARKER;
+	else if (code < 0xC0 || code == JPEG_SOI
+	  || (code >= JPEG_RST0 && code <= JPEG_RST7))
+		verify_fail(io,pv,"Unexpected marker");		/* or reserved */
+	else {
+		pv->marker = code;
+		pv->state = V_LEN1;
+	}
+}
+
+/*
+ * markers in the entropy coded data are searched with memchr(), which
+ * is vectorized in common C libraries; other bytes are not examined
+ */
+void
+verify_data(IO *io, JPEG_VERIFY *pv, const unsigned char *data, size_t len)
+{
+	const unsigned char *end, *ff;
+	size_t skip;
+	int ch;
+
+	for (end = data + len; data < end; ) {
+		switch (pv->state) {
+		case V_DATA:
+			if ( (ff = memchr(data,0xFF,end - data)) == 0) {
+				pv->off += end - data;
+				return;
+			}
+			pv->off += ff + 1 - data;
+			data = ff + 1;
+			pv->state = V_DATA_FF;
+			continue;
+		case V_SKIP:
+			skip = pv->left < end - data ? pv->left : end - data;
+			pv->left -= skip;
+			pv->off += skip;
+			data += skip;
+			if (pv->left == 0)
+				pv->state = pv->marker == JPEG_SOS ? V_DATA : V_MARKER;
+			continue;
+		case V_END:
+			pv->off += end - data;
+			return;
+		}
+		/* one byte at a time */
+		ch = *data++;
+		switch (pv->state) {
+		case V_MARKER:
+			if (ch != 0xFF)
+				verify_fail(io,pv,"Marker expected");
+			pv->state = V_CODE;
+			break;
+		case V_CODE:
+			verify_code(io,pv,ch);
+			break;
+		case V_LEN1:
+			pv->left = ch << 8;
+			pv->state = V_LEN2;
+			break;
+		case V_LEN2:
+			if ( (pv->left += ch) < 2)
+				verify_fail(io,pv,"Invalid segment length");
+			pv->left -= 2;
+			if (pv->marker == JPEG_SOS)
+				pv->next_rst = 0;
+			pv->state = pv->left ? V_SKIP
+			  : pv->marker == JPEG_SOS ? V_DATA : V_MARKER;
+			break;
+		case V_DATA_FF:
+			if (ch == 0)
+				pv->state = V_DATA;		/* stuffed 0xFF data byte */
+			else if (ch >= JPEG_RST0 && ch <= JPEG_RST7) {
+				if (ch != JPEG_RST0 + pv->next_rst)
+					verify_fail(io,pv,"Restart marker out of sequence");
+				pv->next_rst = (pv->next_rst + 1) & 7;
+				pv->state = V_DATA;
+			}
+			else if (ch != 0xFF)
+				verify_code(io,pv,ch);	/* end of the scan */
+			break;
+		}
+		pv->off++;
+	}
+}
+
+void
+verify_end(IO *io, JPEG_VERIFY *pv)
+{
+	if (pv->state != V_END)
+		fail_prog("JPEG file '%s' is truncated, "
+		  "the image data has no end marker",io->ifile);
+}
@@ -0,0 +1,53 @@
+#include "prefix.h"
+
+/* JPEG marker codes */
+#define JPEG_TEM	0x01
+#define JPEG_RST0	0xD0
+#define JPEG_RST7	0xD7
+#define JPEG_SOI	0xD8
+#define JPEG_EOI	0xD9
+#define JPEG_SOS	0xDA
+#define JPEG_APP0	0xE0
+#define JPEG_APP1	0xE1
+#define JPEG_COM	0xFE
+
+#define JPEG_SCAN_BUFF	65536
+
+/* one marker segment */
+typedef struct {
+	U16 marker;					/* marker code without the 0xFF prefix */
+	U32 off;					/* offset of the 0xFF before the code */
+	U32 len;					/* length including the marker */
+} JPEG_SEGMENT;
+
+/*
+ * segments of a JPEG file from SOI to SOS or EOI (both included),
+ * the entropy coded image data after SOS is not scanned
+ */
+typedef struct {
+	JPEG_SEGMENT *seg;
+	int segs, seg_alloc;
+	/* read buffer for stdio input */
+	char *buff;
+	U32 boff;					/* file offset of buff[0] */
+	size_t blen;				/* valid bytes in buff */
+} JPEG_INDEX;
+
+extern void scan_jpeg(IO *, JPEG_INDEX *);
+extern void free_index(JPEG_INDEX *);
+
+/*
+ * check of the image data from the first SOS marker to EOI, the data
+ * can be passed in parts of any size
+ */
+typedef struct {
+	int state;
+	U32 off;					/* file offset of the next byte */
+	U32 left;					/* bytes of the segment to skip */
+	U16 marker;					/* segment being read */
+	int next_rst;				/* expected restart marker 0-7 */
+} JPEG_VERIFY;
+
+extern void verify_init(JPEG_VERIFY *, U32);
+extern void verify_data(IO *, JPEG_VERIFY *, const unsigned char *, size_t);
+extern void verify_end(IO *, JPEG_VERIFY *);
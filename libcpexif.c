@@ -0,0 +1,1968 @@
+/*
+ * libcpexif - copies EXIF data from NEF/TIFF/JPEG file to JPEG file
+ *
+ * Copyright (C)2005 by Vlado Potisk
+ *
+ * This program is free software released under the terms
+ * of the GNU General Public License. There is no warranty,
+ * use it at your own risk.
+ *
+ * Visit http://www.clex.sk/cpexif/ for more information.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "cpexif.h"
+#include "crc.h"
+#include "fail.h"
+#include "inout.h"
+#include "jpeg.h"
+#include "libcpexif.h"
+#include "tags.h"
+#include "uring.h"
+
+/* NEF -> JPG mode definitions */
+#define IFD_SIZE	12
+
+#define TAG_NIKON_ISO		0x2
+#define TAG_NIKON_ISOCODE	0x6
+
+#define READ_GAP	4096	/* read_values() */
+#define DUMP_MAX	256		/* dump_entry(), longer values are not shown */
+
+/* compact directory entry, the values are decoded once when parsing */
+typedef struct {
+	char raw[IFD_SIZE];		/* literal 12 bytes */
+	U16 tag;
+	unsigned char type;
+	unsigned char borrowed;	/* flag: data points into the source */
+	U32 data_size;			/* in bytes */
+	char *data;				/* -> value if data_size > 4 */
+} IFD_ENTRY;
+
+/* the value of an entry, short values are stored in the raw bytes */
+#define ENTRY_DATA(p)	((p)->data_size <= 4 ? (p)->raw + 8 : (p)->data)
+
+/* directory: contiguous entries sorted by tag */
+typedef struct {
+	IFD_ENTRY *entry;
+	int entries;
+} IFD;
+
+/* layout of the MakerNote value */
+typedef struct {
+	int known;					/* flag: the layout is recognized */
+	U32 ifd;					/* offset of the IFD in the value */
+	int endian;					/* byte order of the IFD */
+	int moves;					/* flag: the IFD offsets are relative to
+								   the TIFF header, not to the value */
+	U16 iso_tag;				/* Nikon ISO tag, 0 = none */
+} MAKERNOTE;
+
+/* sizes of one data element of certain IFD type */
+static int memreq[] = { 0,1,1,2,4,8,1,1,2,4,8,4,8 };
+
+/* everything needed to process one source and its destinations */
+typedef struct cpexif_job {
+	IO src;						/* source, open while the job uses it */
+	IO io;						/* destination */
+	int flags;					/* CPEXIF_xxx options */
+	int warnings;				/* CPEXIF_WARN_xxx */
+	int loaded;					/* flag: source has been processed */
+	FAIL_TRAP trap;
+	CPEXIF_IOV *iov;			/* result of cpexif_write_iov() */
+	JPEG_INDEX index;			/* segments of the last scanned JPEG */
+	ARENA arena;				/* IFD data of the current source */
+	TAG_FILTER filter;			/* tags copied from each IFD */
+	int filtered;				/* flag: filter differs from the schema */
+	double timing[CPEXIF_PHASES];	/* seconds spent in each phase */
+	double phase_start;
+	/* JPG -> JPG mode, NEF -> JPG mode after the first destination */
+	const char *app1;			/* JPEG APP1 segment without first 12B */
+	U16 app1_len;				/* length of the APP1 segment */
+	/* NEF -> JPG mode */
+	IFD *ifd0, *exif, *gps, *interop;
+	IFD_ENTRY makernote_field;	/* copy, inserts move the entries */
+	MAKERNOTE makernote;
+	U32 makernote_delta;		/* adjustment already done in MakerNote */
+	/* general */
+	int endian;					/* TIFF structure endian */
+	char *tmp_file;				/* name of the temporary destination */
+	char *cleanup_file;			/* tmp_file while it is incomplete */
+	/* CPEXIF_VERIFY */
+	size_t image_len;			/* destination image data from SOS */
+	U32 image_crc;				/* its CRC-32C with CPEXIF_VERIFYCRC */
+	/* cache of built APP1 segments */
+	CACHE *cache;				/* 0 = no cache */
+	U32 filter_hash;			/* 0 = not computed yet */
+	char cache_key[128];		/* key of the source, "" = do not store */
+} JOB;
+
+static void
+cleanup(JOB *job)
+{
+	if (job->cleanup_file)
+		remove(job->cleanup_file);
+	job->cleanup_file = 0;
+	free(job->tmp_file);
+	job->tmp_file = 0;
+}
+
+/* forget everything about the previous source and release its data */
+static void
+reset_job(JOB *job)
+{
+	arena_reset(&job->arena);
+	job->warnings = 0;
+	job->loaded = 0;
+	job->app1 = 0;
+	job->app1_len = 0;
+	job->ifd0 = job->exif = job->gps = job->interop = 0;
+	memset(&job->makernote_field,0,sizeof(IFD_ENTRY));
+	memset(&job->makernote,0,sizeof(MAKERNOTE));
+	job->makernote_delta = 0;
+	job->endian = 0;
+	job->cache_key[0] = '\0';
+}
+
+static double
+wall_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double)time(0);
+#endif
+}
+
+/* the time since the end of the previous phase is added to this phase */
+static void
+phase_end(JOB *job, int phase)
+{
+	double now;
+
+	now = wall_clock();
+	job->timing[phase] += now - job->phase_start;
+	job->phase_start = now;
+}
+
+static void *
+emalloc(size_t size)
+{
+	void *mem;
+
+	if ((mem = malloc(size)) == 0)
+		fail_prog("Could not allocate %lu bytes of memory",
+		  (unsigned long)size);
+	return mem;
+}
+
+/* the caller stores the entry, a batch goes to insert_entries() */
+static void
+new_entry(JOB *job, IFD_ENTRY *new, U16 tag, U16 type, U32 count)
+{
+	assert(type >= 1 && type <= 12);
+
+	new->borrowed = 0;
+	store_16b(job->endian,new->raw    ,new->tag  = tag);
+	store_16b(job->endian,new->raw + 2,new->type = type);
+	store_32b(job->endian,new->raw + 4,count);
+	store_32b(job->endian,new->raw + 8,0);
+	new->data_size = count * memreq[type];
+	new->data = new->data_size <= 4 ?
+	  0 : arena_alloc(&job->arena,new->data_size);
+}
+
+/* binary search, the first entry of the tag wins */
+static IFD_ENTRY *
+find_entry(U16 tag, U16 type /* 0 = any type */, IFD *pd)
+{
+	IFD_ENTRY *p, *end;
+	int lo, hi, mid;
+
+	for (lo = 0, hi = pd->entries; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (pd->entry[mid].tag < tag)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	end = pd->entry + pd->entries;
+	for (p = pd->entry + lo; p < end && p->tag == tag; p++)
+		if (type == 0 || p->type == type)
+			return p;
+	return 0;
+}
+
+/* stable insertion sort, the entries are mostly sorted already */
+static void
+sort_entries(IFD_ENTRY *entry, int entries)
+{
+	IFD_ENTRY tmp;
+	int i, j;
+
+	for (i = 1; i < entries; i++) {
+		if (entry[i].tag >= entry[i - 1].tag)
+			continue;
+		tmp = entry[i];
+		for (j = i; j > 0 && entry[j - 1].tag > tmp.tag; j--)
+			entry[j] = entry[j - 1];
+		entry[j] = tmp;
+	}
+}
+
+/* merge a batch of new entries into the directory */
+static void
+insert_entries(JOB *job, IFD *pd, IFD_ENTRY *new, int n)
+{
+	IFD_ENTRY *entry;
+	int i, j, k;
+
+	if (n == 0)
+		return;
+	sort_entries(new,n);
+	entry = arena_alloc(&job->arena,(pd->entries + n) * sizeof(IFD_ENTRY));
+	for (i = j = k = 0; k < pd->entries + n; k++)
+		if (j < n && (i == pd->entries || new[j].tag <= pd->entry[i].tag))
+			entry[k] = new[j++];
+		else
+			entry[k] = pd->entry[i++];
+	pd->entry = entry;
+	pd->entries += n;
+}
+
+/* out-of-line value to be read from a stdio input */
+typedef struct {
+	U32 off;
+	IFD_ENTRY *pifd;
+} VALUE;
+
+static int
+cmp_value(const void *a, const void *b)
+{
+	U32 off_a, off_b;
+
+	off_a = ((const VALUE *)a)->off;
+	off_b = ((const VALUE *)b)->off;
+	return off_a < off_b ? -1 : off_a > off_b;
+}
+
+/*
+ * read the values in the file order, values closer than READ_GAP
+ * bytes to each other are read together with one read
+ */
+static void
+read_values(JOB *job, VALUE *val, int vals)
+{
+	int i, j;
+	U32 start, end;
+	char *buff;
+
+	qsort(val,vals,sizeof(VALUE),cmp_value);
+	for (i = 0; i < vals; i = j) {
+		start = val[i].off;
+		end = start + val[i].pifd->data_size;
+		for (j = i + 1; j < vals && val[j].off <= end + READ_GAP; j++)
+			if (val[j].off + val[j].pifd->data_size > end)
+				end = val[j].off + val[j].pifd->data_size;
+		buff = arena_alloc(&job->arena,end - start);
+		set_read_pos(&job->src,SEEK_SET,start);
+		read_from_file(&job->src,buff,end - start);
+		for (; i < j; i++)
+			val[i].pifd->data = buff + (val[i].off - start);
+	}
+}
+
+/* tags read even if they are not copied, parsing needs them */
+static int
+tag_needed(JOB *job, int ifd, U16 tag)
+{
+	if (ifd == IFD_0)
+		return tag == TAG_IFD0_MAKE || tag == TAG_IFD0_EXIF
+		  || tag == TAG_IFD0_DNG;
+	if (ifd == IFD_EXIF)
+		return tag == TAG_EXIF_MAKERNOTE && !(job->flags & CPEXIF_NOISOFIX);
+	return 0;
+}
+
+/* fields of a directory entry */
+typedef struct {
+	U16 tag, type;
+	U32 count, offset;
+} FIELDS;
+
+/* the whole table is decoded at once, one loop for each byte order */
+static void
+decode_directory(int endian, const char *dir, U16 entries, FIELDS *pf)
+{
+	const unsigned char *p;
+
+	p = (const unsigned char *)dir;
+	if (endian == BE)
+		for (; entries; entries--, p += IFD_SIZE, pf++) {
+			pf->tag    = BE_16B(p);
+			pf->type   = BE_16B(p + 2);
+			pf->count  = BE_32B(p + 4);
+			pf->offset = BE_32B(p + 8);
+		}
+	else
+		for (; entries; entries--, p += IFD_SIZE, pf++) {
+			pf->tag    = LE_16B(p);
+			pf->type   = LE_16B(p + 2);
+			pf->count  = LE_32B(p + 4);
+			pf->offset = LE_32B(p + 8);
+		}
+}
+
+/* entries neither copied nor needed are skipped */
+static IFD *
+parse_directory(JOB *job, U32 start, int ifd)
+{
+	const char *dir, *data;
+	char *buff;
+	U16 i, entries;
+	IFD *pd;
+	IFD_ENTRY *pifd;
+	FIELDS *field, *pf;
+	VALUE *val;
+	int vals;
+
+	set_read_pos(&job->src,SEEK_SET,start);
+	if ( (entries = read_16b(&job->src,job->endian) ) == 0)
+		fail_prog("Empty IFD structure encountered");
+	if ( (dir = input_ptr(&job->src,start + 2,IFD_SIZE * entries)) == 0) {
+		buff = arena_alloc(&job->arena,IFD_SIZE * entries);
+		read_from_file(&job->src,buff,IFD_SIZE * entries);
+		dir = buff;
+	}
+	/* start_of_the_next_ifd follows the directory */
+	field = arena_alloc(&job->arena,entries * sizeof(FIELDS));
+	decode_directory(job->endian,dir,entries,field);
+
+	val = arena_alloc(&job->arena,entries * sizeof(VALUE));
+	pd = arena_alloc(&job->arena,sizeof(IFD));
+	pd->entry = arena_alloc(&job->arena,entries * sizeof(IFD_ENTRY));
+	pd->entries = 0;
+	for (vals = i = 0, pf = field; i < entries; i++, pf++, dir += IFD_SIZE) {
+		if (!tag_kept(&job->filter,ifd,pf->tag)
+		  && !tag_needed(job,ifd,pf->tag))
+			continue;	/* the value is not read at all */
+		if (pf->type < 1 || pf->type > 12)
+			fail_prog("IFD entry with tag %X has invalid type %d",
+			  pf->tag,pf->type);
+		if (pf->count > 0xFFFFFFFFUL / memreq[pf->type])
+			fail_prog("IFD entry with tag %X has invalid count %lu",
+			  pf->tag,(unsigned long)pf->count);
+		pifd = pd->entry + pd->entries++;
+		memcpy(pifd->raw,dir,IFD_SIZE);
+		pifd->tag = pf->tag;
+		pifd->type = pf->type;
+		pifd->borrowed = 0;
+		pifd->data = 0;
+		pifd->data_size = pf->count * memreq[pf->type];
+		if (pifd->data_size <= 4)
+			continue;
+		/* data in memory is not copied, it must not be modified */
+		if ( (data = input_ptr(&job->src,pf->offset,pifd->data_size)) ) {
+			pifd->data = (char *)data;
+			pifd->borrowed = 1;
+		}
+		else {
+			val[vals].off = pf->offset;
+			val[vals++].pifd = pifd;
+		}
+	}
+	read_values(job,val,vals);
+	/* TIFF requires ascending tags, not all writers follow it */
+	sort_entries(pd->entry,pd->entries);
+
+	return pd;
+}
+
+/*** MakerNote layouts of the supported vendors ***/
+
+static void
+set_makernote(MAKERNOTE *pm, U32 ifd, int endian, int moves, U16 iso_tag)
+{
+	pm->known = 1;
+	pm->ifd = ifd;
+	pm->endian = endian;
+	pm->moves = moves;
+	pm->iso_tag = iso_tag;
+}
+
+/*
+ * IFD at offset 0, or "Nikon" header and IFD at offset 8,
+ * or "Nikon" header and own TIFF header at offset 10
+ */
+static void
+nikon_makernote(const char *mn, size_t size, int endian, MAKERNOTE *pm)
+{
+	U16 val;
+
+	if (size < 18)
+		return;
+	if (memcmp(mn,"Nikon\0",6)) {
+		set_makernote(pm,0,endian,1,TAG_NIKON_ISO);
+		return;
+	}
+	val = convert_16b(BE,mn + 10);
+	if ((val == BE || val == LE) && convert_16b(val,mn + 12) == 42)
+		set_makernote(pm,10 + convert_32b(val,mn + 14),val,0,TAG_NIKON_ISO);
+	else
+		set_makernote(pm,8,endian,1,TAG_NIKON_ISOCODE);
+}
+
+/* IFD at offset 0, its entries must fit in the value */
+static void
+canon_makernote(const char *mn, size_t size, int endian, MAKERNOTE *pm)
+{
+	U16 entries;
+
+	if (size < 2)
+		return;
+	entries = convert_16b(endian,mn);
+	if (entries > 0 && 2 + IFD_SIZE * (size_t)entries <= size)
+		set_makernote(pm,0,endian,1,0);
+}
+
+/* "SONY DSC " or "SONY CAM " header and IFD at offset 12, or IFD at 0 */
+static void
+sony_makernote(const char *mn, size_t size, int endian, MAKERNOTE *pm)
+{
+	if (size >= 12 && (memcmp(mn,"SONY DSC \0\0\0",12) == 0
+	  || memcmp(mn,"SONY CAM \0\0\0",12) == 0))
+		set_makernote(pm,12,endian,1,0);
+	else
+		set_makernote(pm,0,endian,1,0);
+}
+
+/* byte order mark at the given offset, anything else = TIFF order */
+static int
+mark_endian(const char *ptr, int endian)
+{
+	U16 val;
+
+	val = convert_16b(BE,ptr);
+	return val == BE || val == LE ? val : endian;
+}
+
+/*
+ * "AOC\0" + byte order and IFD at offset 6, "PENTAX \0" + byte order
+ * and IFD at offset 10 (offsets relative to the value), or IFD at 0
+ */
+static void
+pentax_makernote(const char *mn, size_t size, int endian, MAKERNOTE *pm)
+{
+	if (size >= 6 && memcmp(mn,"AOC\0",4) == 0)
+		set_makernote(pm,6,mark_endian(mn + 4,endian),1,0);
+	else if (size >= 10 && memcmp(mn,"PENTAX \0",8) == 0)
+		set_makernote(pm,10,mark_endian(mn + 8,endian),0,0);
+	else
+		set_makernote(pm,0,endian,1,0);
+}
+
+/* supported TIFF based RAW files (NEF, CR2, ARW, PEF), by the Make tag */
+static const struct {
+	const char *make;			/* prefix */
+	void (*makernote)(const char *, size_t, int, MAKERNOTE *);
+} vendor[] = {
+	{ "NIKON",	nikon_makernote },
+	{ "Nikon",	nikon_makernote },
+	{ "Canon",	canon_makernote },
+	{ "SONY",	sony_makernote },
+	{ "PENTAX",	pentax_makernote },
+	{ "RICOH",	pentax_makernote },
+	{ 0,		0 }
+};
+
+/* a DNG file from any camera is accepted, its MakerNote may be unknown */
+static void
+parse_raw(JOB *job, const char *raw_file)
+{
+	IFD_ENTRY *p, *pmn;
+	const char *make;
+	int i;
+
+	job->ifd0 = parse_directory(job,read_32b(&job->src,job->endian),IFD_0);
+	p = find_entry(TAG_IFD0_MAKE,TYPE_ASCII,job->ifd0);
+	make = p ? ENTRY_DATA(p) : 0;
+	for (i = 0; vendor[i].make; i++)
+		if (make && strncmp(make,vendor[i].make,strlen(vendor[i].make)) == 0)
+			break;
+	if (vendor[i].make == 0 && find_entry(TAG_IFD0_DNG,0,job->ifd0) == 0)
+		fail_prog("File '%s' was not produced by a supported camera,\n"
+		  "manufacturer is '%s'",raw_file,make ? make : "<unknown>");
+	if ( (p = find_entry(TAG_IFD0_EXIF,TYPE_ULONG,job->ifd0)) == 0)
+		fail_prog("No EXIF data found in '%s'",raw_file);
+	job->exif =
+	  parse_directory(job,convert_32b(job->endian,p->raw + 8),IFD_EXIF);
+	/* a dropped pointer has not been parsed, the sub-IFD is dropped too */
+	if ( (p = find_entry(TAG_EXIF_INTEROP,TYPE_ULONG,job->exif)) )
+		job->interop =
+		  parse_directory(job,convert_32b(job->endian,p->raw + 8),IFD_INTEROP);
+	if ( (p = find_entry(TAG_IFD0_GPS,TYPE_ULONG,job->ifd0)) )
+		job->gps =
+		  parse_directory(job,convert_32b(job->endian,p->raw + 8),IFD_GPS);
+
+	if ( (pmn = find_entry(TAG_EXIF_MAKERNOTE,0,job->exif)) )
+		job->makernote_field = *pmn;
+	if (pmn && vendor[i].make)
+		vendor[i].makernote(ENTRY_DATA(pmn),pmn->data_size,job->endian,
+		  &job->makernote);
+	if (job->makernote.known && job->makernote.ifd + 2 > pmn->data_size)
+		job->makernote.known = 0;
+}
+
+/*
+ * drop the entries which were read only for parsing and add
+ * the missing required tags with their default values
+ */
+static void
+filter_ifds(JOB *job)
+{
+	IFD *dir[IFDS], *pd;
+	IFD_ENTRY *add;
+	const TAG_RULE *pr;
+	char *data;
+	int ifd, i, n;
+
+	dir[IFD_0] = job->ifd0;
+	dir[IFD_EXIF] = job->exif;
+	dir[IFD_GPS] = job->gps;
+	dir[IFD_INTEROP] = job->interop;
+	for (n = 0, pr = tag_schema; pr->action; pr++)
+		if (pr->action == TAG_REQUIRED)
+			n++;
+	add = arena_alloc(&job->arena,n * sizeof(IFD_ENTRY));
+
+	for (ifd = 0; ifd < IFDS; ifd++) {
+		if ( (pd = dir[ifd]) == 0)
+			continue;
+		for (i = n = 0; i < pd->entries; i++)
+			if (tag_kept(&job->filter,ifd,pd->entry[i].tag))
+				pd->entry[n++] = pd->entry[i];
+		pd->entries = n;
+
+		/* the defaults are inserted together */
+		for (n = 0, pr = tag_schema; pr->action; pr++) {
+			if (pr->action != TAG_REQUIRED || pr->ifd != ifd
+			  || !tag_kept(&job->filter,ifd,pr->tag)
+			  || find_entry(pr->tag,0,pd))
+				continue;
+			new_entry(job,add + n,pr->tag,pr->type,1);
+			data = ENTRY_DATA(add + n);
+			if (pr->type == TYPE_USHORT)
+				store_16b(job->endian,data,pr->value[0]);
+			else {
+				store_32b(job->endian,data,pr->value[0]);
+				if (pr->type == TYPE_URATIO)
+					store_32b(job->endian,data + 4,pr->value[1]);
+			}
+			n++;
+		}
+		insert_entries(job,pd,add,n);
+	}
+}
+
+/* exit value: 0 = OK, -1 = error */
+static int
+isofix(JOB *job)
+{
+	static U16 isocode[] = { 80, 0, 160, 0, 320, 100 };
+	MAKERNOTE *pm;
+	U16 i, entries, iso, tag, type;
+	U32 cnt;
+	IFD_ENTRY iso_entry;
+	const char *ptr;
+
+	if (find_entry(TAG_EXIF_ISO,0,job->exif))
+		return 0;	/* if it is not broken ... */
+
+	pm = &job->makernote;
+	if (!pm->known || pm->iso_tag == 0)
+		return -1;
+	/* ptr = start of makernote IFD */
+	ptr = ENTRY_DATA(&job->makernote_field) + pm->ifd;
+	iso = 0;
+	entries = convert_16b(pm->endian,ptr);
+	if (entries == 0
+	  || pm->ifd + 2 + IFD_SIZE * entries > job->makernote_field.data_size)
+		return -1;
+	for (i = 0, ptr += 2; i < entries; i++, ptr += IFD_SIZE) {
+		tag  = convert_16b(pm->endian,ptr);
+		type = convert_16b(pm->endian,ptr + 2);
+		cnt  = convert_32b(pm->endian,ptr + 4);
+		if (tag != pm->iso_tag || type != TYPE_USHORT)
+			continue;
+		if (tag == TAG_NIKON_ISO && (cnt == 1 || cnt == 2)) {
+			iso = convert_16b(pm->endian,ptr + (cnt == 1 ? 8 : 10));
+			break;
+		}
+		if (tag == TAG_NIKON_ISOCODE && cnt == 1) {
+			iso = convert_16b(pm->endian,ptr + 8);
+			/* 0 = iso80, 2 = iso160, 4 = iso320, 5 = iso100 */
+			if (iso >= 0 && iso <= 5) {
+				iso = isocode[iso];
+				break;
+			}
+		}
+	}
+	if (iso == 0)
+		return -1;
+
+	new_entry(job,&iso_entry,TAG_EXIF_ISO,TYPE_USHORT,1);
+	store_16b(job->endian,ENTRY_DATA(&iso_entry),iso);
+	insert_entries(job,job->exif,&iso_entry,1);
+
+	return 0;
+}
+
+/* make a private copy of data borrowed from the source */
+static void
+own_data(JOB *job, IFD_ENTRY *pifd)
+{
+	char *data;
+
+	if (pifd->borrowed) {
+		data = arena_alloc(&job->arena,pifd->data_size);
+		memcpy(data,pifd->data,pifd->data_size);
+		pifd->data = data;
+		pifd->borrowed = 0;
+	}
+}
+
+/*
+ * the MakerNote value will be written at the given offset,
+ * exit value: 0 = OK, -1 = error
+ */
+static int
+adjust_makernote(JOB *job, IFD_ENTRY *pmn, U32 where)
+{
+	MAKERNOTE *pm;
+	U32 delta;
+	U16 type, i, entries;
+	char *ptr;
+
+	pm = &job->makernote;
+	if (!pm->known)
+		return -1;
+	if (!pm->moves)
+		return 0;	/* nothing to do */
+	own_data(job,pmn);
+	ptr = pmn->data + pm->ifd;
+
+	/* offsets in the makernote IFD need to be recalculated */
+	delta = where - convert_32b(job->endian,pmn->raw + 8)
+	  - job->makernote_delta;
+	entries = convert_16b(pm->endian,ptr);
+	if (entries == 0 || pm->ifd + 2 + IFD_SIZE * entries > pmn->data_size)
+		return -1;
+	for (i = 0, ptr += 2; i < entries; i++, ptr += IFD_SIZE) {
+		type  = convert_16b(pm->endian,ptr + 2);
+		if (type < 1 || type > 12)
+			return -1;
+		if (convert_32b(pm->endian,ptr + 4) * memreq[type] > 4)
+			store_32b(pm->endian,ptr + 8,
+			  convert_32b(pm->endian,ptr + 8) + delta);
+	}
+	job->makernote_delta += delta;
+	return 0;
+}
+
+/* size of an IFD including its data */
+static U32
+ifd_size(IFD *pd)
+{
+	IFD_ENTRY *p, *end;
+	U32 size;
+
+	size = 2 + IFD_SIZE * pd->entries + 4;
+	for (p = pd->entry, end = p + pd->entries; p < end; p++)
+		if (p->data_size > 4)
+			size += p->data_size + p->data_size % 2;
+	return size;
+}
+
+/* store the offset of an IFD to the entry pointing to it */
+static void
+set_pointer(JOB *job, U16 tag, IFD *directory, U32 offset)
+{
+	IFD_ENTRY *pifd;
+
+	pifd = find_entry(tag,0,directory);
+	assert(pifd != 0);
+	store_32b(job->endian,pifd->raw + 8,offset);
+}
+
+/* write an IFD at the given offset (relative to the TIFF header) */
+static void
+write_ifd(JOB *job, IFD *pd, U32 start)
+{
+	U32 data_offset;
+	IFD_ENTRY *p, *end;
+
+	end = pd->entry + pd->entries;
+	/* number of entries */
+	write_16b(&job->io,job->endian,pd->entries);
+	/* directory */
+	data_offset = start + 2 + IFD_SIZE * pd->entries + 4;
+	for (p = pd->entry; p < end; p++) {
+		if (p->data_size <= 4)
+			write_to_file(&job->io,p->raw,IFD_SIZE);
+		else {
+			write_to_file(&job->io,p->raw,IFD_SIZE - 4);
+			write_32b(&job->io,job->endian,data_offset);
+			data_offset += p->data_size + p->data_size % 2;
+		}
+	}
+	/* offset of next IFD */
+	write_32b(&job->io,job->endian,0);
+	/* data, at the offsets written above */
+	data_offset = start + 2 + IFD_SIZE * pd->entries + 4;
+	for (p = pd->entry; p < end; p++)
+		if (p->data_size > 4) {
+			if (p->tag == TAG_EXIF_MAKERNOTE
+			  && adjust_makernote(job,p,data_offset) < 0)
+				fail_prog("Unknown format of the 'MakerNote' field.\n"
+				  "Consider running CPEXIF "
+				  "with the --nomakernote option");
+			write_to_file(&job->io,p->data,p->data_size);
+			if (p->data_size % 2)
+				write_8b(&job->io,0);	/* padding */
+			data_offset += p->data_size + p->data_size % 2;
+		}
+}
+
+/*** cache ***/
+
+/*
+ * the source file identity and everything else affecting the APP1
+ * segment; a modified file gets a new key, its old entry is evicted
+ * later
+ *
+ * exit value: 0 = the source cannot be cached
+ */
+static int
+make_cache_key(JOB *job, const struct stat *st)
+{
+	const unsigned char *pch;
+	size_t i;
+
+	if (!S_ISREG(st->st_mode))
+		return 0;
+	if (job->filter_hash == 0) {
+		/* FNV-1a */
+		job->filter_hash = 2166136261UL;
+		pch = (const unsigned char *)&job->filter;
+		for (i = 0; i < sizeof(TAG_FILTER); i++)
+			job->filter_hash = ((job->filter_hash ^ pch[i]) * 16777619UL)
+			  & 0xFFFFFFFF;
+	}
+	sprintf(job->cache_key,"cpexif1 %lx %lx %lx %lx %lx %x %08lx",
+	  (unsigned long)st->st_dev,(unsigned long)st->st_ino,
+	  (unsigned long)st->st_size,(unsigned long)st->st_mtime,
+	  (unsigned long)st->st_ctime,
+	  job->flags & (CPEXIF_NOMAKERNOTE | CPEXIF_NOISOFIX | CPEXIF_STRIPGPS),
+	  job->filter_hash);
+	return 1;
+}
+
+/*
+ * cache data: TIFF endian (2B), warnings (1B) and the APP1 segment
+ * without the first 12 bytes
+ *
+ * exit value: 1 = the source is loaded from the cache
+ */
+static int
+load_cache(JOB *job, const struct stat *st)
+{
+	const char *data;
+	size_t len;
+
+	if (job->cache == 0 || !make_cache_key(job,st))
+		return 0;
+	if ( (data = cache_get(job->cache,job->cache_key,&job->arena,&len)) == 0
+	  || len < 3 || len - 3 + 12 + 2 > 0xFFFF)
+		return 0;
+	job->endian = convert_16b(BE,data);
+	if (job->endian != BE && job->endian != LE)
+		return 0;
+	job->warnings = data[2] & CPEXIF_WARN_NOISO;
+	job->app1 = data + 3;
+	job->app1_len = len - 3 + 12;
+	job->cache_key[0] = '\0';
+	return 1;
+}
+
+static void
+store_cache(JOB *job)
+{
+	char *data;
+	size_t len;
+
+	len = job->app1_len - 12 + 3;
+	data = arena_alloc(&job->arena,len);
+	store_16b(BE,data,job->endian);
+	data[2] = job->warnings & CPEXIF_WARN_NOISO;
+	memcpy(data + 3,job->app1,job->app1_len - 12);
+	cache_put(job->cache,job->cache_key,data,len);
+	job->cache_key[0] = '\0';
+}
+
+/* JPEG SOI, APP1 header and TIFF header */
+static void
+write_app1_header(JOB *job, U16 app1_len)
+{
+	write_16b(&job->io,BE,0xFFD8);	/* JPEG SOI */
+	write_16b(&job->io,BE,0xFFE1);	/* JPEG APP1 */
+	write_16b(&job->io,BE,app1_len);
+	write_to_file(&job->io,"Exif\0",6);		/* EXIF marker */
+	write_16b(&job->io,BE,job->endian);		/* TIFF header */
+	write_16b(&job->io,job->endian,42);
+}
+
+/*
+ * JPEG SOI and APP1 segments; the layout is computed first,
+ * then the data is written sequentially without seeking back;
+ * the output is always a memory buffer
+ */
+static void
+write_exif(JOB *job)
+{
+	U32 exif_off, interop_off, gps_off, tiff_size, app1_len;
+	size_t start;
+	char *app1;
+
+	if (job->app1) {
+		/* JPEG -> JPEG, or an APP1 segment built before */
+		write_app1_header(job,job->app1_len);
+		write_to_file(&job->io,job->app1,job->app1_len - 12);
+		return;
+	}
+
+	/* NEF -> JPEG: IFD0, EXIF, Interoperability, GPS */
+	exif_off = 8 + ifd_size(job->ifd0);
+	interop_off = exif_off + ifd_size(job->exif);
+	gps_off = interop_off + (job->interop ? ifd_size(job->interop) : 0);
+	tiff_size = gps_off + (job->gps ? ifd_size(job->gps) : 0);
+	app1_len = 2 + 6 + tiff_size;
+	if (app1_len + 2 > 0xFFFF)
+		fail_prog("The EXIF data block is too large, "
+		  "cannot copy it to a JPEG file.\n"
+		  "Consider running CPEXIF with the --nomakernote option\n"
+		  "in order to reduce the size of the EXIF data block");
+	set_pointer(job,TAG_IFD0_EXIF,job->ifd0,exif_off);
+	if (job->interop)
+		set_pointer(job,TAG_EXIF_INTEROP,job->exif,interop_off);
+	if (job->gps)
+		set_pointer(job,TAG_IFD0_GPS,job->ifd0,gps_off);
+
+	start = job->io.opos;
+	write_app1_header(job,app1_len);
+	write_32b(&job->io,job->endian,8);
+	write_ifd(job,job->ifd0,8);
+	write_ifd(job,job->exif,exif_off);
+	if (job->interop)
+		write_ifd(job,job->interop,interop_off);
+	if (job->gps)
+		write_ifd(job,job->gps,gps_off);
+
+	/* the segment is the same for all destinations, keep it */
+	app1 = arena_alloc(&job->arena,app1_len - 12);
+	memcpy(app1,job->io.omem + start + 16,app1_len - 12);
+	job->app1 = app1;
+	job->app1_len = app1_len;
+	if (job->cache_key[0])
+		store_cache(job);
+}
+
+/* segment table of the destination JPEG */
+static void
+index_jpeg(JOB *job, const char *jpeg_in)
+{
+	scan_jpeg(&job->io,&job->index);
+	if (job->index.seg[job->index.segs - 1].marker != JPEG_SOS)
+		fail_prog("There is no image data in '%s'",jpeg_in);
+}
+
+/* copy the indexed JPEG except its SOI, APP0 and APP1 segments */
+static void
+copy_jpeg(JOB *job)
+{
+	JPEG_SEGMENT *ps;
+	int i;
+
+	for (i = 0; i < job->index.segs; i++) {
+		ps = job->index.seg + i;
+		if (ps->marker == JPEG_SOI
+		  || ps->marker == JPEG_APP0 || ps->marker == JPEG_APP1)
+			continue;
+		if (get_read_pos(&job->io) != ps->off)
+			set_read_pos(&job->io,SEEK_SET,ps->off);
+		if (ps->marker == JPEG_SOS)
+			copy_till_eof(&job->io);
+		else
+			copy_data(&job->io,ps->len);
+	}
+}
+
+/*
+ * CPEXIF_VERIFY: check the image data of the destination (SOS to EOI)
+ * before anything is written; the CRC is computed over everything
+ * copied from SOS to the end of the file
+ */
+static void
+verify_image(JOB *job)
+{
+	JPEG_VERIFY v;
+	const char *data;
+	size_t len, chunk;
+	U32 off;
+
+	off = job->index.seg[job->index.segs - 1].off;
+	verify_init(&v,off);
+	job->image_crc = 0;
+	if (job->io.ifp == 0) {
+		len = job->io.isize - off;
+		data = input_ptr(&job->io,off,len);
+		verify_data(&job->io,&v,(const unsigned char *)data,len);
+		if (job->flags & CPEXIF_VERIFYCRC)
+			job->image_crc = crc32c(0,data,len);
+	}
+	else {
+		set_read_pos(&job->io,SEEK_SET,off);
+		for (len = 0; (chunk = read_some(&job->io,job->io.copy_buff,
+		  COPY_BUFF)); len += chunk) {
+			verify_data(&job->io,&v,
+			  (const unsigned char *)job->io.copy_buff,chunk);
+			if (job->flags & CPEXIF_VERIFYCRC)
+				job->image_crc = crc32c(job->image_crc,job->io.copy_buff,
+				  chunk);
+		}
+	}
+	verify_end(&job->io,&v);
+	job->image_len = len;
+}
+
+static void
+verify_crc(JOB *job, U32 crc, const char *file)
+{
+	if (crc != job->image_crc)
+		fail_prog("Verification of '%s' failed, "
+		  "the written image data differs",file);
+}
+
+/* CPEXIF_VERIFYCRC: the image data at the end of the written file */
+static void
+verify_file(JOB *job, const char *file)
+{
+	const char *data;
+	size_t chunk;
+	U32 size, crc;
+
+	open_input(&job->io,file);
+	if ( (size = input_size(&job->io)) < job->image_len)
+		fail_prog("Verification of '%s' failed, the file is truncated",file);
+	if ( (data = input_ptr(&job->io,size - job->image_len,job->image_len)) )
+		crc = crc32c(0,data,job->image_len);
+	else {
+		set_read_pos(&job->io,SEEK_SET,size - job->image_len);
+		for (crc = 0; (chunk = read_some(&job->io,job->io.copy_buff,
+		  COPY_BUFF)); )
+			crc = crc32c(crc,job->io.copy_buff,chunk);
+	}
+	close_input(&job->io);
+	verify_crc(job,crc,file);
+}
+
+/* CPEXIF_VERIFY in the pipe mode, the SOS marker has been copied */
+static void
+verify_stream(JOB *job, U32 off, U16 len)
+{
+	JPEG_VERIFY v;
+	unsigned char sos[4];
+	size_t chunk;
+
+	sos[0] = 0xFF;
+	sos[1] = JPEG_SOS;
+	sos[2] = len >> 8;
+	sos[3] = len & 0xFF;
+	verify_init(&v,off);
+	verify_data(&job->io,&v,sos,4);
+	while ( (chunk = read_some(&job->io,job->io.copy_buff,COPY_BUFF)) ) {
+		verify_data(&job->io,&v,
+		  (const unsigned char *)job->io.copy_buff,chunk);
+		write_to_file(&job->io,job->io.copy_buff,chunk);
+	}
+	verify_end(&job->io,&v);
+}
+
+/*
+ * write the EXIF data prepared in the memory output followed by
+ * the JPEG from an input which cannot seek (pipe): the segments
+ * are copied in one forward pass while they are read
+ */
+static void
+stream_jpeg(JOB *job, const char *jpeg_in)
+{
+	unsigned long start;
+	U16 marker, len;
+
+	/* the input offset, a pipe has no position */
+	start = job->io.stats.bytes_read;
+	if (read_16b(&job->io,BE) != 0xFFD8)
+		fail_prog("File '%s' is not a JPEG",jpeg_in);
+	write_to_file(&job->io,job->io.omem,job->io.osize);
+	for (;;) {
+		if (read_8b(&job->io) != 0xFF)
+			fail_prog("JPEG file '%s' is corrupted",jpeg_in);
+		while ( (marker = read_8b(&job->io)) == 0xFF)
+			;
+		if (marker == JPEG_EOI)
+			fail_prog("There is no image data in '%s'",jpeg_in);
+		if (marker == JPEG_TEM || (marker >= 0xD0 && marker <= 0xD7)) {
+			write_8b(&job->io,0xFF);
+			write_8b(&job->io,marker);
+			continue;
+		}
+		if ((len = read_16b(&job->io,BE)) < 2)
+			fail_prog("JPEG file '%s' is corrupted",jpeg_in);
+		if (marker == JPEG_APP0 || marker == JPEG_APP1) {
+			skip_data(&job->io,len - 2);
+			continue;
+		}
+		write_8b(&job->io,0xFF);
+		write_8b(&job->io,marker);
+		write_16b(&job->io,BE,len);
+		if (marker == JPEG_SOS) {
+			if (job->flags & CPEXIF_VERIFY)
+				verify_stream(job,job->io.stats.bytes_read - start - 4,len);
+			else
+				copy_till_eof(&job->io);
+			return;
+		}
+		copy_data(&job->io,len - 2);
+	}
+}
+
+/* exit value: number of bytes copy_jpeg() will copy, 0 = unknown */
+static U32
+copy_size(JOB *job)
+{
+	JPEG_SEGMENT *ps;
+	U32 size, isize;
+	int i;
+
+	if ( (isize = input_size(&job->io)) == 0)
+		return 0;
+	for (size = 0, i = 0; i < job->index.segs; i++) {
+		ps = job->index.seg + i;
+		if (ps->marker == JPEG_SOI
+		  || ps->marker == JPEG_APP0 || ps->marker == JPEG_APP1)
+			continue;
+		size += ps->marker == JPEG_SOS ? isize - ps->off : ps->len;
+	}
+	return size;
+}
+
+#ifdef WIN32
+# define lstat(file,st)	stat(file,st)
+#endif
+
+/* append a COM segment (total size 4 to 65537 bytes) filled with zeros */
+static void
+write_padding(JOB *job, size_t size)
+{
+	static const char zeros[256];
+	size_t chunk;
+
+	write_16b(&job->io,BE,0xFFFE);	/* JPEG COM */
+	write_16b(&job->io,BE,size - 2);
+	for (size -= 4; size > 0; size -= chunk) {
+		chunk = size > sizeof(zeros) ? sizeof(zeros) : size;
+		write_to_file(&job->io,zeros,chunk);
+	}
+}
+
+/* read the contents of a segment, exit value: 1 = all zeros, 0 = not */
+static int
+read_padding(JOB *job, size_t size)
+{
+	char *buff;
+	size_t i, chunk;
+	int zeros;
+
+	buff = job->io.copy_buff;
+	for (zeros = 1; size > 0; size -= chunk) {
+		chunk = size > COPY_BUFF ? COPY_BUFF : size;
+		read_from_file(&job->io,buff,chunk);
+		for (i = 0; zeros && i < chunk; i++)
+			zeros = buff[i] == 0;
+	}
+	return zeros;
+}
+
+/*
+ * the destination starts with an APP1 segment equal to the new one
+ * and has no other APP0 or APP1 segment, i.e. rewriting the file
+ * would not change the EXIF data; a memory input is compared in place
+ */
+static int
+same_exif(JOB *job)
+{
+	JPEG_SEGMENT *ps;
+	const char *data;
+	size_t off, chunk;
+	int i;
+
+	ps = job->index.seg + 1;
+	if (job->index.segs < 2 || ps->marker != JPEG_APP1 || ps->off != 2
+	  || ps->len != job->io.osize - 2)
+		return 0;
+	for (i = 2; i < job->index.segs; i++)
+		if (job->index.seg[i].marker == JPEG_APP0
+		  || job->index.seg[i].marker == JPEG_APP1)
+			return 0;
+	if ( (data = input_ptr(&job->io,2,ps->len)) )
+		return memcmp(data,job->io.omem + 2,ps->len) == 0;
+	set_read_pos(&job->io,SEEK_SET,2);
+	for (off = 0; off < ps->len; off += chunk) {
+		chunk = ps->len - off < COPY_BUFF ? ps->len - off : COPY_BUFF;
+		read_from_file(&job->io,job->io.copy_buff,chunk);
+		if (memcmp(job->io.copy_buff,job->io.omem + 2 + off,chunk))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * overwrite the APP0/APP1 segments at the beginning of the destination
+ * with the new EXIF data (prepared in the memory output) if they are
+ * large enough, the slack is filled with padding (a COM segment full
+ * of zeros, it is reused next time); the rest of the file including
+ * the image data is not touched
+ *
+ * exit value: 0 = OK, -1 = not possible
+ */
+static int
+patch_jpeg(JOB *job, const char *jpeg_in, const struct stat *st)
+{
+	JPEG_SEGMENT *ps;
+	U32 end;
+	U16 len;
+	size_t slack, chunk;
+	int i;
+
+	for (end = 0, i = 1; i < job->index.segs; i++) {
+		ps = job->index.seg + i;
+		if (ps->marker == JPEG_APP0 || ps->marker == JPEG_APP1) {
+			/* an APP0 or APP1 segment after other segments */
+			if (end)
+				return -1;
+			continue;
+		}
+		if (end == 0 && ps->marker == JPEG_COM) {
+			set_read_pos(&job->io,SEEK_SET,ps->off + 4);
+			if (read_padding(job,ps->len - 4))
+				continue;
+		}
+		if (end == 0)
+			end = ps->off;
+	}
+	if (end < job->io.osize)
+		return -1;	/* does not fit */
+	slack = end - job->io.osize;
+	len = convert_16b(BE,job->io.omem + 4);	/* APP1 length */
+	if (slack > 0 && slack < 4 && len + slack > 0xFFFF)
+		return -1;
+	close_input(&job->io);
+
+	if (slack > 0 && slack < 4) {
+		/* too small for a segment, make the APP1 segment longer */
+		store_16b(BE,job->io.omem + 4,len + slack);
+		write_to_file(&job->io,"\0\0\0",slack);
+	}
+	else
+		for (; slack > 0; slack -= chunk) {
+			chunk = slack > 0xFFFF + 2 ? 0xFFFF + 2 : slack;
+			if (slack - chunk > 0 && slack - chunk < 4)
+				chunk -= 4;
+			write_padding(job,chunk);
+		}
+
+	open_update_output(&job->io,jpeg_in);
+	write_to_file(&job->io,job->io.omem,job->io.osize);
+	if (job->flags & CPEXIF_KEEPTIME)
+		copy_attributes(&job->io,st,ATTR_TIMES);
+	close_output(&job->io);
+	return 0;
+}
+
+/*
+ * the new file replaces the original one by rename() when possible:
+ * a writable regular file (not a symlink) without other hard links;
+ * otherwise the data is copied back in order to keep the original file
+ */
+static void
+create_jpeg(JOB *job, const char *jpeg_in)
+{
+	size_t len;
+	char *jpeg_out;
+	struct stat st;
+	int replace;
+	U32 size;
+
+	if (lstat(jpeg_in,&st) < 0)
+		fail_sys("Cannot find file '%s'",jpeg_in);
+	replace = !(job->flags & CPEXIF_COPYBACK)
+	  && S_ISREG(st.st_mode) && st.st_nlink == 1
+	  && access(jpeg_in,W_OK) == 0;
+
+	/* the new EXIF data is prepared in memory first */
+	open_mem_output(&job->io,"<EXIF data>",0);
+	write_exif(job);
+	phase_end(job,CPEXIF_PHASE_BUILD);
+
+	open_input(&job->io,jpeg_in);
+	index_jpeg(job,jpeg_in);
+	if (job->flags & CPEXIF_VERIFY)
+		verify_image(job);
+	job->warnings &= ~CPEXIF_WARN_UNCHANGED;
+	if (same_exif(job)) {
+		/* nothing to do, the file is not touched at all */
+		close_input(&job->io);
+		job->warnings |= CPEXIF_WARN_UNCHANGED;
+		phase_end(job,CPEXIF_PHASE_FINISH);
+		return;
+	}
+	if ((job->flags & CPEXIF_INPLACE) && patch_jpeg(job,jpeg_in,&st) == 0) {
+		phase_end(job,CPEXIF_PHASE_FINISH);
+		return;
+	}
+
+	len = strlen(jpeg_in);
+	jpeg_out = job->tmp_file = emalloc(len + 8);
+	count_alloc(&job->io,len + 8);
+	strcpy(jpeg_out,jpeg_in);
+	strcpy(jpeg_out + len,".XXXXXX");	/* mk(s)temp() template */
+	open_tmp_output(&job->io,jpeg_out);
+	job->cleanup_file = jpeg_out;
+	/* the output size is known in advance */
+	if ( (size = copy_size(job)) )
+		size += job->io.osize;
+	preallocate_output(&job->io,size);
+
+	write_to_file(&job->io,job->io.omem,job->io.osize);
+	copy_jpeg(job);
+	close_input(&job->io);
+	phase_end(job,CPEXIF_PHASE_COPY);
+
+	if (replace && copy_attributes(&job->io,&st,ATTR_OWNER
+	  | (job->flags & CPEXIF_KEEPTIME ? ATTR_TIMES : 0)) == 0) {
+		/* after a crash the destination is either the old or the new one */
+		sync_output(&job->io);
+		close_output(&job->io);
+		if (job->flags & CPEXIF_VERIFYCRC)
+			verify_file(job,jpeg_out);
+		if (rename(jpeg_out,jpeg_in) < 0)
+			fail_sys("Cannot rename file '%s' to '%s'",jpeg_out,jpeg_in);
+		job->cleanup_file = 0;
+		sync_directory(jpeg_in);
+		cleanup(job);
+		phase_end(job,CPEXIF_PHASE_FINISH);
+		return;
+	}
+	close_output(&job->io);
+	if (job->flags & CPEXIF_VERIFYCRC)
+		verify_file(job,jpeg_out);
+	job->cleanup_file = 0;
+
+	/* copy data to preserve the file ownership */
+	open_output(&job->io,jpeg_in);
+	preallocate_output(&job->io,size);
+	open_input(&job->io,jpeg_out);
+	copy_till_eof(&job->io);
+	close_input(&job->io);
+	if (job->flags & CPEXIF_KEEPTIME)
+		copy_attributes(&job->io,&st,ATTR_TIMES);
+	close_output(&job->io);
+	remove(jpeg_out);
+	cleanup(job);
+	if (job->flags & CPEXIF_VERIFYCRC)
+		verify_file(job,jpeg_in);
+	phase_end(job,CPEXIF_PHASE_FINISH);
+}
+
+/*
+ * the APP1 segment with EXIF data (Exif\0\0 + TIFF header) in the JPEG
+ * input, 0 = none; *endian is set to the TIFF byte order
+ */
+static JPEG_SEGMENT *
+find_exif(IO *io, JPEG_INDEX *idx, int *endian)
+{
+	JPEG_SEGMENT *ps;
+	char head[10];
+	U16 id;
+	int i;
+
+	scan_jpeg(io,idx);
+	for (i = 0; i < idx->segs; i++) {
+		ps = idx->seg + i;
+		if (ps->marker != JPEG_APP1 || ps->len < 18)
+			continue;
+		set_read_pos(io,SEEK_SET,ps->off + 4);
+		read_from_file(io,head,sizeof(head));
+		if (memcmp(head,"Exif\0\0",6) == 0 &&
+		  ((id = convert_16b(BE,head + 6)) == BE || id == LE) &&
+		  convert_16b(id,head + 8) == 42) {
+			*endian = id;
+			return ps;
+		}
+	}
+	return 0;
+}
+
+static void
+parse_jpg(JOB *job, const char *filename)
+{
+	JPEG_SEGMENT *ps;
+	char *app1;
+
+	if ( (ps = find_exif(&job->src,&job->index,&job->endian)) == 0)
+		fail_prog("No EXIF data found in '%s'",filename);
+	job->app1_len = ps->len - 2;
+	if ( (job->app1 = input_ptr(&job->src,ps->off + 14,
+	  job->app1_len - 12)) == 0) {
+		app1 = arena_alloc(&job->arena,job->app1_len - 12);
+		set_read_pos(&job->src,SEEK_SET,ps->off + 14);
+		read_from_file(&job->src,app1,job->app1_len - 12);
+		job->app1 = app1;
+	}
+}
+
+static void
+process_input(JOB *job, const char *file)
+{
+	U16 id;
+
+	id = read_16b(&job->src,BE);
+	if (id == 0xFFD8) {
+		parse_jpg(job,file);
+		if ((job->flags & (CPEXIF_NOISOFIX | CPEXIF_NOMAKERNOTE
+		  | CPEXIF_STRIPGPS)) || job->filtered)
+			job->warnings |= CPEXIF_WARN_OPTIONS;
+	}
+	else if ((id == BE || id == LE) && read_16b(&job->src,id) == 42) {
+		job->endian = id;
+		parse_raw(job,file);
+		filter_ifds(job);
+		if (!(job->flags & CPEXIF_NOISOFIX)
+		  && tag_kept(&job->filter,IFD_EXIF,TAG_EXIF_ISO) && isofix(job) < 0)
+			job->warnings |= CPEXIF_WARN_NOISO;
+	}
+	else
+		fail_prog("File '%s' is not a NEF, TIFF, or JPEG file",file);
+	job->loaded = 1;	/* the source stays open, its data may be in use */
+	phase_end(job,CPEXIF_PHASE_PARSE);
+}
+
+/*** dump ***/
+
+/* a part of the TIFF structure in the APP1 segment, 0 = out of bounds */
+static const char *
+tiff_ptr(JOB *job, U32 off, U32 len)
+{
+	U32 size;
+
+	/* the kept segment starts at the TIFF offset 4 */
+	size = job->app1_len - 12;
+	if (off < 4 || off - 4 > size || len > size - (off - 4))
+		return 0;
+	return job->app1 + (off - 4);
+}
+
+static void
+dump_text(JOB *job, const char *str)
+{
+	write_to_file(&job->io,str,strlen(str));
+}
+
+/* up to the first NUL, bytes above 0x7F are taken as Latin-1 */
+static void
+dump_string(JOB *job, const char *str, U32 len)
+{
+	char buff[8];
+	U32 i, start;
+	int ch;
+
+	dump_text(job,"\"");
+	for (start = i = 0; i < len && str[i]; i++) {
+		ch = str[i] & 0xFF;
+		if (ch >= 0x20 && ch < 0x80 && ch != '"' && ch != '\\')
+			continue;
+		if (i > start)
+			write_to_file(&job->io,str + start,i - start);
+		sprintf(buff,ch == '"' || ch == '\\' ? "\\%c" : "\\u%04x",ch);
+		dump_text(job,buff);
+		start = i + 1;
+	}
+	if (i > start)
+		write_to_file(&job->io,str + start,i - start);
+	dump_text(job,"\"");
+}
+
+static long
+signed_32b(U32 num)
+{
+	return num & 0x80000000UL ? -(long)(~num & 0x7FFFFFFFUL) - 1 : (long)num;
+}
+
+/* IEEE 754 number, NaN and infinity do not exist in JSON */
+static void
+format_float(char *buff, int endian, const char *ptr, int size)
+{
+	static const U16 one = 1;
+	union {
+		float f;
+		double d;
+		unsigned char b[8];
+	} u;
+	double num;
+	int i, same;
+
+	same = (*(const unsigned char *)&one == 1) == (endian == LE);
+	for (i = 0; i < size; i++)
+		u.b[same ? i : size - 1 - i] = ptr[i];
+	num = size == 4 ? u.f : u.d;
+	if (num != num || num - num != 0)
+		strcpy(buff,"null");
+	else
+		sprintf(buff,"%.*g",size == 4 ? 9 : 17,num);
+}
+
+/* one element of a numeric value */
+static void
+dump_number(JOB *job, U16 type, const char *ptr)
+{
+	char buff[64];
+	int endian;
+	U16 num;
+
+	endian = job->endian;
+	switch (type) {
+	case TYPE_BYTE:
+		sprintf(buff,"%d",*ptr & 0xFF);
+		break;
+	case TYPE_SBYTE:
+		sprintf(buff,"%d",(*ptr & 0xFF) - (*ptr & 0x80 ? 0x100 : 0));
+		break;
+	case TYPE_USHORT:
+		sprintf(buff,"%u",convert_16b(endian,ptr));
+		break;
+	case TYPE_SSHORT:
+		num = convert_16b(endian,ptr);
+		sprintf(buff,"%ld",(long)num - (num & 0x8000 ? 0x10000L : 0));
+		break;
+	case TYPE_ULONG:
+		sprintf(buff,"%lu",(unsigned long)convert_32b(endian,ptr));
+		break;
+	case TYPE_SLONG:
+		sprintf(buff,"%ld",signed_32b(convert_32b(endian,ptr)));
+		break;
+	case TYPE_URATIO:
+		sprintf(buff,"[%lu,%lu]",(unsigned long)convert_32b(endian,ptr),
+		  (unsigned long)convert_32b(endian,ptr + 4));
+		break;
+	case TYPE_SRATIO:
+		sprintf(buff,"[%ld,%ld]",signed_32b(convert_32b(endian,ptr)),
+		  signed_32b(convert_32b(endian,ptr + 4)));
+		break;
+	default:	/* TYPE_FLOAT, TYPE_DOUBLE */
+		format_float(buff,endian,ptr,memreq[type]);
+	}
+	dump_text(job,buff);
+}
+
+/*
+ * {"tag":N,"type":N,"count":N,"value":V}, V is a string for ASCII,
+ * a hex string for UNDEFINED, a number or [numerator,denominator],
+ * an array of them for count > 1, or null if it cannot be shown
+ */
+static void
+dump_entry(JOB *job, const char *entry)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *value;
+	char buff[64];
+	U16 tag, type;
+	U32 count, size, i;
+
+	tag = convert_16b(job->endian,entry);
+	type = convert_16b(job->endian,entry + 2);
+	count = convert_32b(job->endian,entry + 4);
+	sprintf(buff,"{\"tag\":%u,\"type\":%u,\"count\":%lu,\"value\":",
+	  tag,type,(unsigned long)count);
+	dump_text(job,buff);
+
+	value = 0;
+	size = 0;
+	if (type >= 1 && type <= 12 && count > 0
+	  && count <= 0xFFFFFFFFUL / memreq[type]) {
+		size = count * memreq[type];
+		value = size <= 4 ? entry + 8
+		  : tiff_ptr(job,convert_32b(job->endian,entry + 8),size);
+	}
+	if (value == 0 || (size > DUMP_MAX && type != TYPE_ASCII))
+		dump_text(job,"null");
+	else if (type == TYPE_ASCII)
+		dump_string(job,value,size);
+	else if (type == TYPE_UNDEFINED) {
+		dump_text(job,"\"");
+		for (i = 0; i < size; i++) {
+			buff[2 * (i % 16)] = hex[value[i] >> 4 & 0xF];
+			buff[2 * (i % 16) + 1] = hex[value[i] & 0xF];
+			if (i % 16 == 15 || i == size - 1)
+				write_to_file(&job->io,buff,2 * (i % 16 + 1));
+		}
+		dump_text(job,"\"");
+	}
+	else {
+		if (count > 1)
+			dump_text(job,"[");
+		for (i = 0; i < count; i++, value += memreq[type]) {
+			if (i > 0)
+				dump_text(job,",");
+			dump_number(job,type,value);
+		}
+		if (count > 1)
+			dump_text(job,"]");
+	}
+	dump_text(job,"}");
+}
+
+/* the directory at the offset, fails if it is out of the segment */
+static const char *
+dump_dir(JOB *job, U32 off, U16 *entries)
+{
+	const char *dir;
+
+	if ( (dir = tiff_ptr(job,off,2)) == 0
+	  || (*entries = convert_16b(job->endian,dir)) == 0
+	  || tiff_ptr(job,off + 2,IFD_SIZE * *entries) == 0)
+		fail_prog("The EXIF data is damaged, invalid IFD offset %lu",
+		  (unsigned long)off);
+	return dir + 2;
+}
+
+/* offset of the sub-IFD the tag in the directory points to, 0 = none */
+static U32
+sub_ifd(JOB *job, U32 off, U16 tag)
+{
+	const char *dir;
+	U16 i, entries;
+
+	dir = dump_dir(job,off,&entries);
+	for (i = 0; i < entries; i++, dir += IFD_SIZE)
+		if (convert_16b(job->endian,dir) == tag
+		  && convert_16b(job->endian,dir + 2) == TYPE_ULONG
+		  && convert_32b(job->endian,dir + 4) == 1)
+			return convert_32b(job->endian,dir + 8);
+	return 0;
+}
+
+/* ,"name":[entries] */
+static void
+dump_ifd(JOB *job, const char *name, U32 off)
+{
+	const char *dir;
+	U16 i, entries;
+
+	dir = dump_dir(job,off,&entries);
+	dump_text(job,",\"");
+	dump_text(job,name);
+	dump_text(job,"\":[");
+	for (i = 0; i < entries; i++, dir += IFD_SIZE) {
+		if (i > 0)
+			dump_text(job,",");
+		dump_entry(job,dir);
+	}
+	dump_text(job,"]");
+}
+
+/*
+ * members of a JSON object: "byte_order" and an array of entries
+ * for each of the IFD0, EXIF, GPS and Interop IFDs present
+ */
+static void
+dump_exif(JOB *job)
+{
+	U32 ifd0, exif, gps, interop;
+
+	dump_text(job,job->endian == BE ? "\"byte_order\":\"MM\""
+	  : "\"byte_order\":\"II\"");
+	ifd0 = convert_32b(job->endian,job->app1);
+	dump_ifd(job,"ifd0",ifd0);
+	if ( (exif = sub_ifd(job,ifd0,TAG_IFD0_EXIF)) ) {
+		dump_ifd(job,"exif",exif);
+		if ( (interop = sub_ifd(job,exif,TAG_EXIF_INTEROP)) )
+			dump_ifd(job,"interop",interop);
+	}
+	if ( (gps = sub_ifd(job,ifd0,TAG_IFD0_GPS)) )
+		dump_ifd(job,"gps",gps);
+}
+
+/*** library interface ***/
+
+/*
+ * failures inside the library functions are caught by the job's trap
+ * and turned into return codes, the library never exits the program
+ */
+static int
+failure(JOB *job, FAIL_TRAP *prev)
+{
+	abort_io(&job->io);
+	cleanup(job);
+	fail_trap(prev);
+	return job->trap.sys ? CPEXIF_ESYS : CPEXIF_EDATA;
+}
+
+static int
+success(JOB *job, FAIL_TRAP *prev)
+{
+	fail_trap(prev);
+	job->trap.msg[0] = '\0';
+	return CPEXIF_OK;
+}
+
+static int
+not_loaded(JOB *job)
+{
+	strcpy(job->trap.msg,"No EXIF source has been loaded");
+	return CPEXIF_ESTATE;
+}
+
+CPEXIF_JOB *
+cpexif_new(int flags)
+{
+	JOB *job;
+
+	if ( (job = malloc(sizeof(JOB))) == 0)
+		return 0;
+	memset(job,0,sizeof(JOB));
+	if (flags & CPEXIF_VERIFYCRC)
+		flags |= CPEXIF_VERIFY;
+	job->flags = flags;
+	init_filter(&job->filter);
+	if (flags & CPEXIF_NOMAKERNOTE)
+		set_filter(&job->filter,IFD_EXIF,TAG_EXIF_MAKERNOTE,0);
+	if (flags & CPEXIF_STRIPGPS)
+		set_filter(&job->filter,IFD_0,TAG_IFD0_GPS,0);
+	/* the source is parsed, the destination is copied */
+	if (!(flags & CPEXIF_NOADVICE)) {
+		job->src.advice = ADVISE_RANDOM;
+		job->io.advice = ADVISE_SEQUENTIAL;
+	}
+	if (flags & CPEXIF_DROPCACHE) {
+		job->src.advice |= ADVISE_DROP;
+		job->io.advice |= ADVISE_DROP;
+	}
+	job->src.nomap = job->io.nomap = (flags & CPEXIF_NOMAP) != 0;
+	job->io.nouring = (flags & CPEXIF_NOURING) != 0;
+	reset_job(job);
+	return job;
+}
+
+int
+cpexif_filter_tag(CPEXIF_JOB *job, int ifd, unsigned int tag, int keep)
+{
+	if (ifd < CPEXIF_IFD_ALL || ifd >= IFDS || tag > 0xFFFF) {
+		sprintf(job->trap.msg,"Invalid IFD %d or tag %X",ifd,tag);
+		return CPEXIF_EDATA;
+	}
+	if (!keep && tag == TAG_IFD0_EXIF
+	  && (ifd == IFD_0 || ifd == CPEXIF_IFD_ALL)) {
+		strcpy(job->trap.msg,"The EXIF pointer cannot be dropped");
+		return CPEXIF_EDATA;
+	}
+	if (ifd == CPEXIF_IFD_ALL)
+		for (ifd = 0; ifd < IFDS; ifd++)
+			set_filter(&job->filter,ifd,tag,keep);
+	else
+		set_filter(&job->filter,ifd,tag,keep);
+	job->filtered = 1;
+	job->filter_hash = 0;
+	job->trap.msg[0] = '\0';
+	return CPEXIF_OK;
+}
+
+int
+cpexif_set_cache(CPEXIF_JOB *job, const char *dir, unsigned long max_size)
+{
+	FAIL_TRAP *prev;
+
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	cache_close(job->cache);
+	job->cache = 0;
+	if (dir && (job->cache = cache_open(dir,max_size)) == 0)
+		fail_sys("Cannot use the cache directory '%s'",dir);
+	return success(job,prev);
+}
+
+int
+cpexif_has_exif(CPEXIF_JOB *job, const char *file)
+{
+	FAIL_TRAP *prev;
+	int endian, found;
+
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	open_input(&job->io,file);
+	found = find_exif(&job->io,&job->index,&endian) != 0;
+	close_input(&job->io);
+	success(job,prev);
+	return found;
+}
+
+void
+cpexif_free(CPEXIF_JOB *job)
+{
+	if (job == 0)
+		return;
+	abort_io(&job->src);
+	abort_io(&job->io);
+	cleanup(job);
+	free(job->io.omem);
+	free(job->io.span);
+	uring_close(job->io.ring);
+	cache_close(job->cache);
+	free(job->iov);
+	free_index(&job->index);
+	arena_free(&job->arena);
+	free(job);
+}
+
+int
+cpexif_load_file(CPEXIF_JOB *job, const char *file)
+{
+	FAIL_TRAP *prev;
+	struct stat st;
+
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	reset_job(job);
+	close_input(&job->src);
+	/* the cache key comes from the file which would be read */
+	hold_input(&job->src,file,&st);
+	if (load_cache(job,&st)) {
+		/* the source file is not read at all */
+		close_input(&job->src);
+		job->loaded = 1;
+		phase_end(job,CPEXIF_PHASE_PARSE);
+		return success(job,prev);
+	}
+	start_input(&job->src,&st);
+	process_input(job,file);
+	return success(job,prev);
+}
+
+int
+cpexif_load_buffer(CPEXIF_JOB *job, const void *buff, size_t size)
+{
+	FAIL_TRAP *prev;
+
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	reset_job(job);
+	close_input(&job->src);
+	open_mem_input(&job->src,"<source buffer>",buff,size);
+	process_input(job,"<source buffer>");
+	return success(job,prev);
+}
+
+int
+cpexif_write_file(CPEXIF_JOB *job, const char *file)
+{
+	FAIL_TRAP *prev;
+
+	if (!job->loaded)
+		return not_loaded(job);
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	create_jpeg(job,file);
+	return success(job,prev);
+}
+
+int
+cpexif_write_stream(CPEXIF_JOB *job, FILE *in, FILE *out)
+{
+	FAIL_TRAP *prev;
+
+	if (!job->loaded)
+		return not_loaded(job);
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	open_mem_output(&job->io,"<EXIF data>",0);
+	write_exif(job);
+	phase_end(job,CPEXIF_PHASE_BUILD);
+	open_stream_input(&job->io,"<input stream>",in);
+	open_stream_output(&job->io,"<output stream>",out);
+	stream_jpeg(job,"<input stream>");
+	close_input(&job->io);
+	phase_end(job,CPEXIF_PHASE_COPY);
+	close_output(&job->io);
+	phase_end(job,CPEXIF_PHASE_FINISH);
+	return success(job,prev);
+}
+
+int
+cpexif_write_buffer(CPEXIF_JOB *job, const void *jpeg, size_t size,
+  void **out, size_t *out_size)
+{
+	FAIL_TRAP *prev;
+
+	if (!job->loaded)
+		return not_loaded(job);
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	open_mem_output(&job->io,"<output buffer>",0);
+	write_exif(job);
+	phase_end(job,CPEXIF_PHASE_BUILD);
+	open_mem_input(&job->io,"<destination buffer>",jpeg,size);
+	index_jpeg(job,"<destination buffer>");
+	if (job->flags & CPEXIF_VERIFY)
+		verify_image(job);
+	copy_jpeg(job);
+	close_input(&job->io);
+	if (job->flags & CPEXIF_VERIFYCRC)
+		verify_crc(job,crc32c(0,job->io.omem + job->io.osize
+		  - job->image_len,job->image_len),"<output buffer>");
+	phase_end(job,CPEXIF_PHASE_COPY);
+	/* the caller becomes the owner of the buffer */
+	*out = job->io.omem;
+	*out_size = job->io.osize;
+	job->io.omem = 0;
+	job->io.oalloc = 0;
+	return success(job,prev);
+}
+
+int
+cpexif_write_iov(CPEXIF_JOB *job, const void *jpeg, size_t size,
+  const CPEXIF_IOV **iov, int *iov_cnt)
+{
+	FAIL_TRAP *prev;
+	SPAN *ps;
+	int i;
+
+	if (!job->loaded)
+		return not_loaded(job);
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	open_mem_output(&job->io,"<output buffer>",1);
+	write_exif(job);
+	phase_end(job,CPEXIF_PHASE_BUILD);
+	open_mem_input(&job->io,"<destination buffer>",jpeg,size);
+	index_jpeg(job,"<destination buffer>");
+	/* the image data is not copied, there is no CRC to compare */
+	if (job->flags & CPEXIF_VERIFY)
+		verify_image(job);
+	copy_jpeg(job);
+	close_input(&job->io);
+	phase_end(job,CPEXIF_PHASE_COPY);
+	free(job->iov);
+	job->iov = emalloc(job->io.spans * sizeof(CPEXIF_IOV));
+	count_alloc(&job->io,job->io.spans * sizeof(CPEXIF_IOV));
+	for (i = 0; i < job->io.spans; i++) {
+		ps = job->io.span + i;
+		job->iov[i].base = ps->ext ? ps->ext : job->io.omem + ps->off;
+		job->iov[i].len = ps->len;
+	}
+	*iov = job->iov;
+	*iov_cnt = job->io.spans;
+	return success(job,prev);
+}
+
+int
+cpexif_dump(CPEXIF_JOB *job, const char **json, size_t *len)
+{
+	FAIL_TRAP *prev;
+
+	if (!job->loaded)
+		return not_loaded(job);
+	prev = fail_trap(&job->trap);
+	if (setjmp(job->trap.env))
+		return failure(job,prev);
+	job->phase_start = wall_clock();
+	if (job->app1 == 0) {
+		open_mem_output(&job->io,"<EXIF data>",0);
+		write_exif(job);
+	}
+	open_mem_output(&job->io,"<JSON text>",0);
+	dump_exif(job);
+	write_8b(&job->io,0);
+	phase_end(job,CPEXIF_PHASE_BUILD);
+	*json = job->io.omem;
+	*len = job->io.osize - 1;
+	return success(job,prev);
+}
+
+const char *
+cpexif_error(CPEXIF_JOB *job)
+{
+	return job->trap.msg;
+}
+
+int
+cpexif_warnings(CPEXIF_JOB *job)
+{
+	return job->warnings;
+}
+
+const double *
+cpexif_timing(CPEXIF_JOB *job)
+{
+	return job->timing;
+}
+
+void
+cpexif_stats(CPEXIF_JOB *job, CPEXIF_STATS *st)
+{
+	IO_STATS *src, *dst;
+
+	src = &job->src.stats;
+	dst = &job->io.stats;
+	st->reads = src->reads + dst->reads;
+	st->bytes_read = src->bytes_read + dst->bytes_read;
+	st->writes = src->writes + dst->writes;
+	st->bytes_written = src->bytes_written + dst->bytes_written;
+	st->seeks = src->seeks + dst->seeks;
+	st->allocs = src->allocs + dst->allocs + job->arena.allocs;
+	st->bytes_alloc = src->bytes_alloc + dst->bytes_alloc + job->arena.bytes;
+}
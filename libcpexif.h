@@ -0,0 +1,155 @@
+/*
+ * libcpexif - copies EXIF data from NEF/TIFF/JPEG file to JPEG file
+ *
+ * Usage: create a job with cpexif_new(), load the source with
+ * cpexif_load_file() or cpexif_load_buffer(), then write the EXIF data
+ * to one or more destinations with cpexif_write_xxx(). A job can be
+ * reused for another source, different jobs can be used in different
+ * threads at the same time.
+ *
+ * All functions returning int return CPEXIF_OK or an error code,
+ * cpexif_error() then describes the problem.
+ */
+
+#ifndef LIBCPEXIF_H
+#define LIBCPEXIF_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cpexif_job CPEXIF_JOB;
+
+/* one part of a scattered output */
+typedef struct {
+	const void *base;
+	size_t len;
+} CPEXIF_IOV;
+
+/* option flags for cpexif_new() */
+#define CPEXIF_NOMAKERNOTE	1	/* do not copy the MakerNote field */
+#define CPEXIF_NOISOFIX		2	/* do not fix the missing ISO field */
+#define CPEXIF_COPYBACK		4	/* never replace the destination file */
+#define CPEXIF_KEEPTIME		8	/* keep destination file time stamps */
+#define CPEXIF_INPLACE		16	/* patch the destination file in place */
+#define CPEXIF_STRIPGPS		32	/* do not copy the GPS data */
+#define CPEXIF_NOADVICE		64	/* no file access hints to the kernel */
+#define CPEXIF_DROPCACHE	128	/* drop the files from the page cache
+								   when they are done */
+#define CPEXIF_VERIFY		256	/* check the destination image data */
+#define CPEXIF_VERIFYCRC	512	/* CPEXIF_VERIFY, then compare the CRC
+								   of the written image data */
+#define CPEXIF_NOMAP		1024	/* read the files instead of mapping
+								   them, so that a file truncated
+								   meanwhile cannot raise SIGBUS */
+#define CPEXIF_NOURING		2048	/* write large blocks with stdio,
+								   not through io_uring */
+
+/* IFDs for cpexif_filter_tag() */
+#define CPEXIF_IFD_ALL		(-1)
+#define CPEXIF_IFD0			0
+#define CPEXIF_IFD_EXIF		1
+#define CPEXIF_IFD_GPS		2
+#define CPEXIF_IFD_INTEROP	3
+
+/* warning flags returned by cpexif_warnings() */
+#define CPEXIF_WARN_OPTIONS	1	/* options ignored in JPEG -> JPEG mode */
+#define CPEXIF_WARN_NOISO	2	/* ISO value not found in the MakerNote */
+#define CPEXIF_WARN_UNCHANGED	4	/* cpexif_write_file() did not modify
+									   the file, its EXIF data is identical */
+
+/* phases of the work measured by cpexif_timing() */
+#define CPEXIF_PHASE_PARSE	0	/* read and parse the source */
+#define CPEXIF_PHASE_BUILD	1	/* build the EXIF APP1 segment */
+#define CPEXIF_PHASE_COPY	2	/* copy the destination image data */
+#define CPEXIF_PHASE_FINISH	3	/* replace or update the destination */
+#define CPEXIF_PHASES		4
+
+/* I/O and memory statistics returned by cpexif_stats() */
+typedef struct {
+	unsigned long reads, bytes_read;
+	unsigned long writes, bytes_written;
+	unsigned long seeks;
+	unsigned long allocs, bytes_alloc;
+} CPEXIF_STATS;
+
+/* return codes */
+#define CPEXIF_OK			0
+#define CPEXIF_ESYS			(-1)	/* system error (I/O, memory) */
+#define CPEXIF_EDATA		(-2)	/* invalid or unsupported data */
+#define CPEXIF_ESTATE		(-3)	/* no source has been loaded */
+
+extern CPEXIF_JOB *cpexif_new(int);
+extern void cpexif_free(CPEXIF_JOB *);
+
+/*
+ * copy (keep = 1) or drop (keep = 0) the tag in the IFD instead of
+ * following the built-in tag schema; dropping a pointer tag drops
+ * the whole sub-IFD, the EXIF pointer cannot be dropped; the filter
+ * does not apply in the JPEG -> JPEG mode
+ */
+extern int cpexif_filter_tag(CPEXIF_JOB *, int, unsigned int, int);
+
+/*
+ * keep the EXIF data built from RAW source files in the directory
+ * (created if needed) and use it instead of parsing a source file
+ * again until the file is modified; the least recently used entries
+ * are removed when the total size exceeds max_size (0 = no limit);
+ * several jobs and processes can share the directory, dir 0 = no cache
+ */
+extern int cpexif_set_cache(CPEXIF_JOB *, const char *, unsigned long);
+
+/*
+ * source: TIFF based RAW (NEF, CR2, ARW, PEF, DNG) or JPEG; a source
+ * buffer must stay valid until another source is loaded or the job
+ * is freed; the source is parsed and its EXIF data is built only once
+ * for all destinations written after loading it
+ */
+extern int cpexif_load_file(CPEXIF_JOB *, const char *);
+extern int cpexif_load_buffer(CPEXIF_JOB *, const void *, size_t);
+
+/*
+ * destination: JPEG; cpexif_write_buffer() returns a new buffer
+ * to be released with free(), the cpexif_write_iov() list refers to
+ * the destination buffer and to memory owned by the job which is valid
+ * until the next call; cpexif_write_stream() reads the JPEG from the
+ * first stream and writes the result to the second one without seeking
+ * (pipes are fine), the streams are not closed
+ */
+extern int cpexif_write_file(CPEXIF_JOB *, const char *);
+extern int cpexif_write_stream(CPEXIF_JOB *, FILE *, FILE *);
+extern int cpexif_write_buffer(CPEXIF_JOB *, const void *, size_t,
+  void **, size_t *);
+extern int cpexif_write_iov(CPEXIF_JOB *, const void *, size_t,
+  const CPEXIF_IOV **, int *);
+
+/*
+ * the EXIF data of the loaded source as it would be copied, in the form
+ * of JSON object members: "byte_order" and the entries of the IFD0, EXIF,
+ * Interop and GPS IFDs; the NUL terminated text is owned by the job and
+ * valid until the next call
+ */
+extern int cpexif_dump(CPEXIF_JOB *, const char **, size_t *);
+
+/*
+ * 1 = the JPEG file already contains EXIF data, 0 = it does not;
+ * the loaded source is not affected
+ */
+extern int cpexif_has_exif(CPEXIF_JOB *, const char *);
+
+extern const char *cpexif_error(CPEXIF_JOB *);
+extern int cpexif_warnings(CPEXIF_JOB *);
+
+/* wall-clock seconds spent in each phase since the job was created */
+extern const double *cpexif_timing(CPEXIF_JOB *);
+/* totals since the job was created */
+extern void cpexif_stats(CPEXIF_JOB *, CPEXIF_STATS *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
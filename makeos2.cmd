@@ -1,4 +1,4 @@
-gcc -O2 -c cpexif.c fail.c options.c inout.c
-gcc -static -o cpexif.exe cpexif.o fail.o options.o inout.o
-del cpexif.o fail.o options.o inout.o > NUL
+gcc -O2 -DNO_THREADS -c cpexif.c libcpexif.c arena.c cache.c crc.c fail.c options.c inout.c jpeg.c pool.c tags.c uring.c
+gcc -static -o cpexif.exe cpexif.o libcpexif.o arena.o cache.o crc.o fail.o options.o inout.o jpeg.o pool.o tags.o uring.o
+del cpexif.o libcpexif.o arena.o cache.o crc.o fail.o options.o inout.o jpeg.o pool.o tags.o uring.o > NUL
 REM lxlite cpexif.exe
@@ -1,12 +1,31 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "libcpexif.h"
 #include "options.h"
 #include "fail.h"
 
 int nomakernote = 0;
 int noisofix = 0;
+const char *batch_file = 0;
+int jobs = 1;
+int copyback = 0;
+int keeptime = 0;
+int inplace = 0;
+int stats = 0;
+int stripgps = 0;
+int recursive = 0;
+const char *cache_dir = 0;
+unsigned long cache_size = 64;		/* MB */
+int page_cache = PAGE_CACHE_HINT;
+int verify = 0;
+int dump = 0;
+const char *serve_path = 0;
+int queue_size = 0;
+TAG_OPTION *tag_option = 0;
+int tag_options = 0;
 
 static const char *progname;
 
@@ -32,14 +51,56 @@ usage_info(void)
 	  "  %s source.jpg destination.jpg\n"
 	  "      Copy the EXIF data from the source JPEG file\n"
 	  "      to the destination JPEG file.\n"
-	  "  %s [options] source.nef destination.jpg\n"
+	  "  %s [options] source.nef destination.jpg [destination.jpg]...\n"
 	  "      options:\n"
 	  "          --nomakernote    do not copy the MakerNote field\n"
 	  "          --noisofix       do not fix the missing ISO field\n"
-	  "      Copy the EXIF data from the source NEF file\n"
-	  "      (Nikon RAW file) to the destination JPEG file.\n"
-	  "      Thumbnails are not copied.\n",
-	  progname,progname,progname,progname);
+	  "          --copyback       rewrite the destination file in place\n"
+	  "          --keeptime       keep the destination file time stamps\n"
+	  "          --inplace        patch the destination file if possible\n"
+	  "          --stats          print I/O statistics as JSON lines\n"
+	  "          --strip-gps      do not copy the GPS data\n"
+	  "          --keep-tags LIST copy these tags\n"
+	  "          --drop-tags LIST do not copy these tags\n"
+	  "          --cache DIR      cache the EXIF data in the directory\n"
+	  "          --cache-size MB  cache size limit, 0 = none (default 64)\n"
+	  "          --page-cache P   page cache policy: normal, hint (default)\n"
+	  "                           or drop\n"
+	  "          --verify         check the destination image data\n"
+	  "          --verify-crc     also compare the CRC of the written data\n"
+	  "      LIST: comma separated tags, optionally prefixed by the IFD,\n"
+	  "      e.g. 'exif:0x927C,gps:0x1D' (IFDs: ifd0, exif, gps, interop)\n"
+	  "      Copy the EXIF data from the source RAW file (Nikon NEF,\n"
+	  "      Canon CR2, Sony ARW, Pentax PEF, or DNG) to the destination\n"
+	  "      JPEG file.\n"
+	  "      Thumbnails are not copied. With several destinations\n"
+	  "      the source is read and the EXIF data is built only once.\n"
+	  "      Use '-' as the destination to read the JPEG data\n"
+	  "      from the standard input and write to the standard output.\n"
+	  "  %s [options] --dump source...\n"
+	  "      Print the EXIF data which would be copied from each source\n"
+	  "      as a JSON line, no file is written.\n"
+	  "  %s [options] --batch manifest\n"
+	  "      Process all 'source destination' pairs listed\n"
+	  "      in the manifest file, one pair per line, or with --dump\n"
+	  "      all sources listed in it, one source per line.\n"
+	  "      Use '-' as the manifest name to read the standard input.\n"
+	  "      options:\n"
+	  "          --jobs N         process N pairs in parallel\n"
+	  "  %s [options] --serve socket\n"
+	  "      Run as a server: accept 'source destination [flags]' lines\n"
+	  "      on the Unix domain socket and answer each with a JSON line.\n"
+	  "      flags: comma separated long option names, e.g. 'noisofix'\n"
+	  "      options:\n"
+	  "          --jobs N         process N requests in parallel\n"
+	  "          --queue N        queued requests limit (default 4 * N)\n"
+	  "  %s [options] --recursive source_dir destination_dir\n"
+	  "      Pair the RAW files in the source tree with the JPEG files\n"
+	  "      of the same name in the destination tree and process\n"
+	  "      the pairs like in the batch mode. Destinations newer than\n"
+	  "      the source which already contain EXIF data are skipped.\n",
+	  progname,progname,progname,progname,progname,progname,progname,
+	  progname);
 }
 
 static void
@@ -54,10 +115,50 @@ version_info(void)
 	  progname);
 }
 
+/* LIST: [ifd:]tag[,[ifd:]tag]... , no IFD = all IFDs */
+static void
+parse_tags(const char *list, int keep)
+{
+	static const char *ifd_name[] = { "ifd0", "exif", "gps", "interop" };
+	char *copy, *item, *pch, *end;
+	unsigned long tag;
+	int ifd;
+
+	if ( (copy = malloc(strlen(list) + 1)) == 0)
+		fail_prog("Could not allocate %lu bytes of memory",
+		  (unsigned long)strlen(list) + 1);
+	strcpy(copy,list);
+	for (item = strtok(copy,","); item; item = strtok(0,",")) {
+		ifd = CPEXIF_IFD_ALL;
+		if ( (pch = strchr(item,':')) ) {
+			*pch++ = '\0';
+			for (ifd = 0; ifd < 4 && strcmp(item,ifd_name[ifd]); ifd++)
+				;
+			if (ifd == 4)
+				fail_prog("Unknown IFD '%s' in '%s'",item,list);
+		}
+		else
+			pch = item;
+		tag = strtoul(pch,&end,0);
+		if (*pch == '\0' || *end != '\0' || tag > 0xFFFF)
+			fail_prog("Invalid tag '%s' in '%s'",pch,list);
+		if ( (tag_option = realloc(tag_option,
+		  (tag_options + 1) * sizeof(TAG_OPTION))) == 0)
+			fail_prog("Could not allocate %lu bytes of memory",
+			  (unsigned long)((tag_options + 1) * sizeof(TAG_OPTION)));
+		tag_option[tag_options].ifd = ifd;
+		tag_option[tag_options].tag = tag;
+		tag_option[tag_options++].keep = keep;
+	}
+	free(copy);
+}
+
 extern char **
 process_options(int ac, char **av)
 {
+	static const char *policy_name[] = { "normal", "hint", "drop" };
 	const char *opt;
+	char *end;
 
 	progname = base_name(av[0]);
 	while (--ac > 0 && strncmp(*++av,"--",2) == 0) {
@@ -74,11 +175,83 @@ process_options(int ac, char **av)
 			nomakernote = 1;
 		else if (strcmp(opt,"noisofix") == 0)
 			noisofix = 1;
+		else if (strcmp(opt,"copyback") == 0)
+			copyback = 1;
+		else if (strcmp(opt,"keeptime") == 0)
+			keeptime = 1;
+		else if (strcmp(opt,"inplace") == 0)
+			inplace = 1;
+		else if (strcmp(opt,"stats") == 0)
+			stats = 1;
+		else if (strcmp(opt,"strip-gps") == 0)
+			stripgps = 1;
+		else if (strcmp(opt,"recursive") == 0)
+			recursive = 1;
+		else if (strcmp(opt,"verify") == 0)
+			verify = VERIFY_SCAN;
+		else if (strcmp(opt,"verify-crc") == 0)
+			verify = VERIFY_CRC;
+		else if (strcmp(opt,"dump") == 0)
+			dump = 1;
+		else if (strcmp(opt,"keep-tags") == 0
+		  || strcmp(opt,"drop-tags") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			parse_tags(*++av,opt[0] == 'k');
+		}
+		else if (strcmp(opt,"batch") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			batch_file = *++av;
+		}
+		else if (strcmp(opt,"cache") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			cache_dir = *++av;
+		}
+		else if (strcmp(opt,"cache-size") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			cache_size = strtoul(*++av,&end,10);
+			/* the size in bytes must fit in an unsigned long */
+			if (**av == '\0' || *end != '\0' || cache_size > ULONG_MAX >> 20)
+				fail_prog("Invalid cache size '%s'",*av);
+		}
+		else if (strcmp(opt,"page-cache") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			av++;
+			for (page_cache = 0; page_cache < 3
+			  && strcmp(*av,policy_name[page_cache]); page_cache++)
+				;
+			if (page_cache == 3)
+				fail_prog("Unknown page cache policy '%s'",*av);
+		}
+		else if (strcmp(opt,"serve") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			serve_path = *++av;
+		}
+		else if (strcmp(opt,"queue") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			if ( (queue_size = atoi(*++av)) < 1)
+				fail_prog("Invalid queue size '%s'",*av);
+		}
+		else if (strcmp(opt,"jobs") == 0) {
+			if (--ac == 0)
+				fail_prog("Option '--%s' requires an argument",opt);
+			if ( (jobs = atoi(*++av)) < 1)
+				fail_prog("Invalid number of jobs '%s'",*av);
+		}
 		else
 			fail_prog("Incorrect option '--%s'. "
 			  "Try '%s --help' for more information",opt,progname);
 	}
-	if (ac != 2)
+	if ((batch_file != 0) + (serve_path != 0) + recursive > 1
+	  || (serve_path && dump)
+	  || (batch_file || serve_path ? ac != 0
+	  : recursive ? ac != 2 || dump : ac < (dump ? 1 : 2)))
 		fail_prog("Incorrect usage. "
 		  "Try '%s --help' for more information",progname);
 	return av;
@@ -1,3 +1,36 @@
 extern char **process_options(int, char **);
 extern int nomakernote;
 extern int noisofix;
+extern const char *batch_file;
+extern int jobs;
+extern int copyback;
+extern int keeptime;
+extern int inplace;
+extern int stats;
+extern int stripgps;
+extern int recursive;
+extern const char *cache_dir;
+extern unsigned long cache_size;
+extern int page_cache;
+extern int verify;
+extern int dump;
+extern const char *serve_path;
+extern int queue_size;
+
+/* --page-cache policies */
+#define PAGE_CACHE_NORMAL	0	/* no hints */
+#define PAGE_CACHE_HINT		1	/* access pattern hints */
+#define PAGE_CACHE_DROP		2	/* hints, drop the files when done */
+
+/* --verify levels */
+#define VERIFY_SCAN		1	/* check the destination image data */
+#define VERIFY_CRC		2	/* compare the written data too */
+
+/* --keep-tags and --drop-tags in the command line order */
+typedef struct {
+	int ifd;					/* CPEXIF_IFD_xxx */
+	unsigned int tag;
+	int keep;
+} TAG_OPTION;
+extern TAG_OPTION *tag_option;
+extern int tag_options;
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <stdlib.h>
+#ifndef WIN32
+# include <unistd.h>
+#endif
+
+#include "pool.h"
+#include "fail.h"
+
+#if !defined(NO_THREADS) && defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+# define HAVE_THREADS
+#endif
+
+#ifndef HAVE_THREADS
+
+POOL *
+pool_create(int workers)
+{
+	return 0;
+}
+
+void
+pool_submit(POOL *pool, TASK_FN fn, void *arg)
+{
+}
+
+void
+pool_wait(POOL *pool)
+{
+}
+
+void
+pool_destroy(POOL *pool)
+{
+}
+
+#else
+
+#include <pthread.h>
+
+typedef struct {
+	TASK_FN fn;
+	void *arg;
+} TASK;
+
+/*
+ * task queue of one worker: the owner takes tasks from the head,
+ * other workers steal from the tail
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	TASK *task;					/* circular buffer */
+	int head, count, size;
+} QUEUE;
+
+typedef struct {
+	pthread_t thread;
+	POOL *pool;
+	int num;
+	QUEUE queue;
+} WORKER;
+
+struct pool {
+	pthread_mutex_t lock;		/* protects the counters below */
+	pthread_cond_t work;		/* signalled when a task is queued */
+	pthread_cond_t idle;		/* signalled when all tasks are done */
+	int queued;					/* tasks waiting in the queues */
+	int running;				/* tasks being executed */
+	int shutdown;
+	int next;					/* round-robin submission */
+	int workers;
+	WORKER *worker;
+};
+
+static void *
+emalloc(size_t size)
+{
+	void *mem;
+
+	if ((mem = malloc(size)) == 0)
+		fail_prog("Could not allocate %lu bytes of memory",
+		  (unsigned long)size);
+	return mem;
+}
+
+static void
+queue_push(QUEUE *pq, TASK_FN fn, void *arg)
+{
+	TASK *new;
+	int i;
+
+	pthread_mutex_lock(&pq->lock);
+	if (pq->count == pq->size) {
+		new = emalloc(2 * pq->size * sizeof(TASK));
+		for (i = 0; i < pq->count; i++)
+			new[i] = pq->task[(pq->head + i) % pq->size];
+		free(pq->task);
+		pq->task = new;
+		pq->head = 0;
+		pq->size *= 2;
+	}
+	i = (pq->head + pq->count++) % pq->size;
+	pq->task[i].fn = fn;
+	pq->task[i].arg = arg;
+	pthread_mutex_unlock(&pq->lock);
+}
+
+/* exit value: 1 = got a task, 0 = queue is empty */
+static int
+queue_pop(QUEUE *pq, int steal, TASK *ptask)
+{
+	int found;
+
+	pthread_mutex_lock(&pq->lock);
+	if ( (found = pq->count > 0) ) {
+		pq->count--;
+		if (steal)
+			*ptask = pq->task[(pq->head + pq->count) % pq->size];
+		else {
+			*ptask = pq->task[pq->head];
+			pq->head = (pq->head + 1) % pq->size;
+		}
+	}
+	pthread_mutex_unlock(&pq->lock);
+	return found;
+}
+
+static void *
+worker_main(void *arg)
+{
+	WORKER *self;
+	POOL *pool;
+	TASK task;
+	int i;
+
+	self = arg;
+	pool = self->pool;
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->work,&pool->lock);
+		if (pool->queued == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return 0;
+		}
+		/* one of the queued tasks is reserved for us */
+		pool->queued--;
+		pool->running++;
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i = self->num; !queue_pop(&pool->worker[i].queue,
+		  i != self->num,&task); i = (i + 1) % pool->workers)
+			;
+		task.fn(task.arg,self->num);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->running == 0 && pool->queued == 0)
+			pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+POOL *
+pool_create(int workers)
+{
+	POOL *pool;
+	WORKER *pw;
+	int i;
+
+	pool = emalloc(sizeof(POOL));
+	pthread_mutex_init(&pool->lock,0);
+	pthread_cond_init(&pool->work,0);
+	pthread_cond_init(&pool->idle,0);
+	pool->queued = pool->running = pool->shutdown = pool->next = 0;
+	pool->workers = workers;
+	pool->worker = emalloc(workers * sizeof(WORKER));
+	for (i = 0; i < workers; i++) {
+		pw = pool->worker + i;
+		pw->pool = pool;
+		pw->num = i;
+		pthread_mutex_init(&pw->queue.lock,0);
+		pw->queue.size = 16;
+		pw->queue.task = emalloc(pw->queue.size * sizeof(TASK));
+		pw->queue.head = pw->queue.count = 0;
+	}
+	for (i = 0; i < workers; i++)
+		if ( (errno = pthread_create(&pool->worker[i].thread,0,
+		  worker_main,pool->worker + i)) )
+			fail_sys("Cannot create a worker thread");
+	return pool;
+}
+
+void
+pool_submit(POOL *pool, TASK_FN fn, void *arg)
+{
+	queue_push(&pool->worker[pool->next].queue,fn,arg);
+	pool->next = (pool->next + 1) % pool->workers;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* wait until all submitted tasks are finished */
+void
+pool_wait(POOL *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->queued > 0 || pool->running > 0)
+		pthread_cond_wait(&pool->idle,&pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_destroy(POOL *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->workers; i++) {
+		pthread_join(pool->worker[i].thread,0);
+		pthread_mutex_destroy(&pool->worker[i].queue.lock);
+		free(pool->worker[i].queue.task);
+	}
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->worker);
+	free(pool);
+}
+
+#endif
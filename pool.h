@@ -0,0 +1,12 @@
+/*
+ * pool of worker threads with per-worker task queues and work stealing;
+ * without thread support pool_create() fails and the caller runs
+ * the tasks itself
+ */
+typedef struct pool POOL;
+typedef void (*TASK_FN)(void *, int);	/* arg, worker number */
+
+extern POOL *pool_create(int);
+extern void pool_submit(POOL *, TASK_FN, void *);
+extern void pool_wait(POOL *);
+extern void pool_destroy(POOL *);
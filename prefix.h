@@ -0,0 +1,74 @@
+/*
+ * the modules of libcpexif.a are linked into other programs, so their
+ * external names get the cpexif_ prefix; each internal header includes
+ * this file before its declarations
+ */
+#define arena_alloc			cpexif_arena_alloc
+#define arena_free			cpexif_arena_free
+#define arena_reset			cpexif_arena_reset
+
+#define cache_close			cpexif_cache_close
+#define cache_get			cpexif_cache_get
+#define cache_open			cpexif_cache_open
+#define cache_put			cpexif_cache_put
+
+#define crc32c				cpexif_crc32c
+
+#define fail_prog			cpexif_fail_prog
+#define fail_sys			cpexif_fail_sys
+#define fail_trap			cpexif_fail_trap
+
+#define abort_io			cpexif_abort_io
+#define close_input			cpexif_close_input
+#define close_output		cpexif_close_output
+#define convert_16b			cpexif_convert_16b
+#define convert_32b			cpexif_convert_32b
+#define copy_attributes		cpexif_copy_attributes
+#define copy_data			cpexif_copy_data
+#define copy_till_eof		cpexif_copy_till_eof
+#define count_alloc			cpexif_count_alloc
+#define get_read_pos		cpexif_get_read_pos
+#define get_write_pos		cpexif_get_write_pos
+#define hold_input			cpexif_hold_input
+#define input_ptr			cpexif_input_ptr
+#define input_size			cpexif_input_size
+#define open_input			cpexif_open_input
+#define open_mem_input		cpexif_open_mem_input
+#define open_mem_output		cpexif_open_mem_output
+#define open_output			cpexif_open_output
+#define open_stream_input	cpexif_open_stream_input
+#define open_stream_output	cpexif_open_stream_output
+#define open_tmp_output		cpexif_open_tmp_output
+#define open_update_output	cpexif_open_update_output
+#define preallocate_output	cpexif_preallocate_output
+#define read_16b			cpexif_read_16b
+#define read_32b			cpexif_read_32b
+#define read_8b				cpexif_read_8b
+#define read_from_file		cpexif_read_from_file
+#define read_some			cpexif_read_some
+#define set_read_pos		cpexif_set_read_pos
+#define set_write_pos		cpexif_set_write_pos
+#define skip_data			cpexif_skip_data
+#define start_input			cpexif_start_input
+#define store_16b			cpexif_store_16b
+#define store_32b			cpexif_store_32b
+#define sync_directory		cpexif_sync_directory
+#define sync_output			cpexif_sync_output
+#define write_16b			cpexif_write_16b
+#define write_32b			cpexif_write_32b
+#define write_8b			cpexif_write_8b
+#define write_to_file		cpexif_write_to_file
+
+#define free_index			cpexif_free_index
+#define scan_jpeg			cpexif_scan_jpeg
+#define verify_data			cpexif_verify_data
+#define verify_end			cpexif_verify_end
+#define verify_init			cpexif_verify_init
+
+#define init_filter			cpexif_init_filter
+#define set_filter			cpexif_set_filter
+#define tag_schema			cpexif_tag_schema
+
+#define uring_close			cpexif_uring_close
+#define uring_open			cpexif_uring_open
+#define uring_write			cpexif_uring_write
@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "cpexif.h"
+#include "tags.h"
+
+/* action for tags not listed in the schema */
+static const int ifd_default[IFDS] = {
+	TAG_DROP,	/* IFD0 */
+	TAG_KEEP,	/* EXIF */
+	TAG_KEEP,	/* GPS */
+	TAG_KEEP	/* Interop */
+};
+
+const TAG_RULE tag_schema[] = {
+	{ IFD_0,	0x10E,	TAG_KEEP },		/* ImageDescription */
+	{ IFD_0,	TAG_IFD0_MAKE,	TAG_KEEP },
+	{ IFD_0,	0x110,	TAG_KEEP },		/* Model */
+	{ IFD_0,	0x112,	TAG_KEEP },		/* Orientation */
+	{ IFD_0,	0x11A,	TAG_REQUIRED,	TYPE_URATIO,	{ 300, 1 } },
+										/* XResolution */
+	{ IFD_0,	0x11B,	TAG_REQUIRED,	TYPE_URATIO,	{ 300, 1 } },
+										/* YResolution */
+	{ IFD_0,	0x128,	TAG_REQUIRED,	TYPE_USHORT,	{ 2 } },
+										/* ResolutionUnit: dpi */
+	{ IFD_0,	0x131,	TAG_KEEP },		/* Software */
+	{ IFD_0,	0x132,	TAG_KEEP },		/* DateTime */
+	{ IFD_0,	0x13B,	TAG_KEEP },		/* Artist */
+	{ IFD_0,	0x213,	TAG_REQUIRED,	TYPE_USHORT,	{ 2 } },
+										/* YCbCrPositioning: co-sited */
+	{ IFD_0,	0x8298,	TAG_KEEP },		/* Copyright */
+	{ IFD_0,	TAG_IFD0_EXIF,	TAG_KEEP },
+	{ IFD_0,	TAG_IFD0_GPS,	TAG_KEEP },
+	{ 0 }
+};
+
+/* the default filter according to the schema */
+void
+init_filter(TAG_FILTER *pf)
+{
+	const TAG_RULE *pr;
+	int ifd;
+
+	for (ifd = 0; ifd < IFDS; ifd++)
+		memset(pf->keep[ifd],ifd_default[ifd] == TAG_DROP ? 0 : 0xFF,
+		  sizeof(pf->keep[ifd]));
+	for (pr = tag_schema; pr->action; pr++)
+		set_filter(pf,pr->ifd,pr->tag,pr->action != TAG_DROP);
+}
+
+void
+set_filter(TAG_FILTER *pf, int ifd, U16 tag, int keep)
+{
+	if (keep)
+		pf->keep[ifd][tag >> 3] |= 1 << (tag & 7);
+	else
+		pf->keep[ifd][tag >> 3] &= ~(1 << (tag & 7));
+}
@@ -0,0 +1,57 @@
+#include "prefix.h"
+
+/* IFD entry types */
+#define TYPE_BYTE		1
+#define TYPE_ASCII		2
+#define TYPE_USHORT		3
+#define TYPE_ULONG		4
+#define TYPE_URATIO		5
+#define TYPE_SBYTE		6
+#define TYPE_UNDEFINED	7
+#define TYPE_SSHORT		8
+#define TYPE_SLONG		9
+#define TYPE_SRATIO		10
+#define TYPE_FLOAT		11
+#define TYPE_DOUBLE		12
+
+#define TAG_IFD0_MAKE		0x010F
+#define TAG_IFD0_EXIF		0x8769
+#define TAG_IFD0_GPS		0x8825
+#define TAG_IFD0_DNG		0xC612	/* DNGVersion */
+#define TAG_EXIF_ISO		0x8827
+#define TAG_EXIF_MAKERNOTE	0x927C
+#define TAG_EXIF_INTEROP	0xA005
+
+/* IFDs, the same numbers as CPEXIF_IFD_xxx */
+#define IFD_0			0
+#define IFD_EXIF		1
+#define IFD_GPS			2
+#define IFD_INTEROP		3
+#define IFDS			4
+
+/* actions of the tag schema */
+#define TAG_KEEP		1	/* copy the tag if present */
+#define TAG_DROP		2	/* do not copy the tag */
+#define TAG_REQUIRED	3	/* copy the tag, add the default if missing */
+
+typedef struct {
+	U16 ifd, tag;
+	int action;
+	/* default value (count 1) of a TAG_REQUIRED tag */
+	U16 type;
+	U32 value[2];				/* USHORT or ULONG, or URATIO */
+} TAG_RULE;
+
+/* terminated by an entry with action 0 */
+extern const TAG_RULE tag_schema[];
+
+/* one bit per tag in each IFD, set = copy the tag */
+typedef struct {
+	unsigned char keep[IFDS][65536 / 8];
+} TAG_FILTER;
+
+#define tag_kept(pf,ifd,tag) \
+	((pf)->keep[ifd][(tag) >> 3] & 1 << ((tag) & 7))
+
+extern void init_filter(TAG_FILTER *);
+extern void set_filter(TAG_FILTER *, int, U16, int);
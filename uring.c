@@ -0,0 +1,234 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_IO_URING
+# endif
+#endif
+
+#ifndef HAVE_IO_URING
+
+URING *
+uring_open(void)
+{
+	return 0;
+}
+
+void
+uring_close(URING *ring)
+{
+}
+
+long
+uring_write(URING *ring, int fd, const char *data, size_t len, long off)
+{
+	return -1;
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* the rings are shared with the kernel */
+#define load_acquire(p)		__atomic_load_n(p,__ATOMIC_ACQUIRE)
+#define store_release(p,v)	__atomic_store_n(p,v,__ATOMIC_RELEASE)
+
+struct uring {
+	int fd;
+	int failed;					/* flag: requests may be left behind */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	void *sq_map, *cq_map;
+	size_t sq_size, cq_size, sqe_size;
+	/* the part of the data each request is writing */
+	struct {
+		const char *data;
+		size_t len;
+		long off;
+	} slot[URING_DEPTH];
+};
+
+/*
+ * io_uring is not available or it is disabled, do not try again;
+ * shared by all threads
+ */
+static _Atomic int unavailable = 0;
+
+URING *
+uring_open(void)
+{
+	struct io_uring_params p;
+	URING *ring;
+	int fd;
+
+	if (unavailable)
+		return 0;
+	memset(&p,0,sizeof(p));
+	if ( (fd = syscall(__NR_io_uring_setup,URING_DEPTH,&p)) < 0) {
+		unavailable = 1;
+		return 0;
+	}
+	/* IORING_OP_WRITE is as old as this feature (Linux 5.6) */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)
+	  || (ring = malloc(sizeof(URING))) == 0) {
+		unavailable = !(p.features & IORING_FEAT_RW_CUR_POS);
+		close(fd);
+		return 0;
+	}
+	ring->fd = fd;
+	ring->failed = 0;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes
+	  + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sq_map = mmap(0,ring->sq_size,PROT_READ | PROT_WRITE,
+	  MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	ring->cq_map = mmap(0,ring->cq_size,PROT_READ | PROT_WRITE,
+	  MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	ring->sqe = mmap(0,ring->sqe_size,PROT_READ | PROT_WRITE,
+	  MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED
+	  || ring->sqe == MAP_FAILED) {
+		uring_close(ring);
+		return 0;
+	}
+	ring->sq_head = (unsigned int *)((char *)ring->sq_map + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_map + p.sq_off.tail);
+	ring->sq_mask =
+	  (unsigned int *)((char *)ring->sq_map + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_map + p.sq_off.array);
+	ring->cq_head = (unsigned int *)((char *)ring->cq_map + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_map + p.cq_off.tail);
+	ring->cq_mask =
+	  (unsigned int *)((char *)ring->cq_map + p.cq_off.ring_mask);
+	ring->cqe = (struct io_uring_cqe *)((char *)ring->cq_map + p.cq_off.cqes);
+	return ring;
+}
+
+void
+uring_close(URING *ring)
+{
+	if (ring == 0)
+		return;
+	if (ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map,ring->sq_size);
+	if (ring->cq_map != MAP_FAILED)
+		munmap(ring->cq_map,ring->cq_size);
+	if (ring->sqe != MAP_FAILED)
+		munmap(ring->sqe,ring->sqe_size);
+	close(ring->fd);
+	free(ring);
+}
+
+/* queue a write of the slot's data */
+static void
+queue_write(URING *ring, int fd, int n)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	sqe = ring->sqe + idx;
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)ring->slot[n].data;
+	sqe->len = ring->slot[n].len;
+	sqe->off = ring->slot[n].off;
+	sqe->user_data = n;
+	ring->sq_array[idx] = idx;
+	store_release(ring->sq_tail,tail + 1);
+}
+
+/*
+ * write the data at the file offset with up to URING_DEPTH writes
+ * in flight; all requests are finished when the function returns,
+ * except after a failed io_uring_enter(): the ring is then unusable
+ * and must be closed
+ *
+ * exit value: number of write requests, -1 = error (errno is set)
+ */
+long
+uring_write(URING *ring, int fd, const char *data, size_t len, long off)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	size_t pos, chunk;
+	long requests, rv;
+	int n, pending, inflight, error;
+	int free_slot[URING_DEPTH], free_slots;
+
+	if (ring->failed) {
+		errno = EIO;
+		return -1;
+	}
+	for (n = 0; n < URING_DEPTH; n++)
+		free_slot[n] = n;
+	free_slots = URING_DEPTH;
+	requests = 0;
+	error = 0;
+	pending = 0;	/* queued, but not submitted yet */
+	inflight = 0;	/* submitted, but not completed yet */
+	for (pos = 0; (pos < len && !error) || pending || inflight; ) {
+		for (; free_slots && pos < len && !error; pos += chunk) {
+			chunk = len - pos < URING_CHUNK ? len - pos : URING_CHUNK;
+			n = free_slot[--free_slots];
+			ring->slot[n].data = data + pos;
+			ring->slot[n].len = chunk;
+			ring->slot[n].off = off + pos;
+			queue_write(ring,fd,n);
+			pending++;
+		}
+		if ( (rv = syscall(__NR_io_uring_enter,ring->fd,pending,1,
+		  IORING_ENTER_GETEVENTS,0,0)) < 0) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				/* stale requests would confuse the next call */
+				ring->failed = 1;
+				return -1;
+			}
+			rv = 0;
+		}
+		/* rv = number of submitted requests */
+		pending -= rv;
+		inflight += rv;
+		requests += rv;
+
+		for (head = *ring->cq_head; head != load_acquire(ring->cq_tail);
+		  head++) {
+			cqe = ring->cqe + (head & *ring->cq_mask);
+			n = cqe->user_data;
+			inflight--;
+			if (cqe->res <= 0 && !error)
+				error = cqe->res < 0 ? -cqe->res : EIO;
+			if (cqe->res > 0 && cqe->res < ring->slot[n].len && !error) {
+				/* short write, the rest goes again */
+				ring->slot[n].data += cqe->res;
+				ring->slot[n].len -= cqe->res;
+				ring->slot[n].off += cqe->res;
+				queue_write(ring,fd,n);
+				pending++;
+			}
+			else
+				free_slot[free_slots++] = n;
+		}
+		store_release(ring->cq_head,head);
+	}
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return requests;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#include "prefix.h"
+
+/*
+ * optional io_uring engine for large file writes (Linux), without
+ * io_uring support uring_open() fails and stdio is used instead
+ */
+typedef struct uring URING;
+
+#define URING_DEPTH		8			/* writes in flight */
+#define URING_CHUNK		262144		/* bytes per write */
+#define URING_MIN		(2 * URING_CHUNK)	/* smaller writes use stdio */
+
+extern URING *uring_open(void);
+extern void uring_close(URING *);
+extern long uring_write(URING *, int, const char *, size_t, long);